@@ -1,10 +1,31 @@
 // Buffer cache.
 //
-// The buffer cache is a linked list of buf structures holding
+// The buffer cache is a hash table of buf structures holding
 // cached copies of disk block contents.  Caching disk blocks
 // in memory reduces the number of disk reads and also provides
 // a synchronization point for disk blocks used by multiple processes.
 //
+// Each hash bucket has its own lock, so looking up or releasing
+// different blocks does not contend. A miss recycles an unused
+// buffer in clock order: the hand sweeps the buffers, giving the
+// ones released since it last passed a second chance, and locks
+// only the bucket of the buffer under it. Misses are serialized
+// by bcache.lock, so that two of them cannot add the same block,
+// and lookups never take it.
+//
+// Locks are taken in the order bcache.lock, then bucket locks
+// (in address order). None of them is held together with the
+// disk driver's vdisk_lock: the driver is called holding only
+// buffer sleeplocks, and its interrupt calls bdone only after
+// releasing vdisk_lock.
+//
+// Buffers live in groups of BPERGROUP, one kalloc() page per
+// group. The cache starts with NBUF buffers and grows a group at
+// a time on misses, up to NBUFMAX buffers while memory is not
+// short, so a large working set stays cached. When kalloc() runs
+// out of memory, it gives back the groups none of whose buffers
+// are in use (see bshrink).
+//
 // Interface:
 // * To get a buffer for a particular disk block, call bread.
 // * After changing buffer data, call bwrite to write it to disk.
@@ -23,69 +44,303 @@
 #include "fs.h"
 #include "buf.h"
 
-struct {
+struct bucket {
   struct spinlock lock;
-  struct buf buf[NBUF];
+  struct buf *head;
+};
 
-  // Linked list of all buffers, through prev/next.
-  // Sorted by how recently the buffer was used.
-  // head.next is most recent, head.prev is least.
-  struct buf head;
+#define BPERGROUP ((PGSIZE - sizeof(void*)) / sizeof(struct buf))
+
+// a page of buffers
+struct bgroup {
+  struct bgroup *next;    // list of all groups
+  struct buf buf[BPERGROUP];
+};
+
+struct {
+  struct spinlock lock;   // serializes misses, growing and shrinking
+  struct bucket bucket[NBUFBUCKET];
+  struct bgroup *groups;
+  int nbuf;
+  struct bgroup *handg;   // clock hand: buffer hand of group handg
+  int hand;
 } bcache;
 
+static struct bucket*
+bhash(uint dev, uint blockno)
+{
+  return &bcache.bucket[(dev * 31 + blockno) % NBUFBUCKET];
+}
+
+// Add a group of unused buffers to the cache.
+// Returns -1 if out of memory.
+// The page is allocated before any bio lock is taken: kalloc
+// may run bshrink when memory is short.
+static int
+bgrow(void)
+{
+  struct bgroup *g;
+  struct bucket *h;
+  struct buf *b;
+
+  if((g = (struct bgroup*)kalloc()) == 0)
+    return -1;
+
+  acquire(&bcache.lock);
+  // new buffers are unused and in the bucket of block 0, and
+  // the clock hand takes them without a second chance
+  h = bhash(0, 0);
+  acquire(&h->lock);
+  for(b = g->buf; b < g->buf+BPERGROUP; b++){
+    memset(b, 0, sizeof(*b));
+    initsleeplock(&b->lock, "buffer");
+    b->next = h->head;
+    h->head = b;
+  }
+  release(&h->lock);
+  g->next = bcache.groups;
+  bcache.groups = g;
+  bcache.nbuf += BPERGROUP;
+  release(&bcache.lock);
+  return 0;
+}
+
 void
 binit(void)
 {
-  struct buf *b;
+  struct bucket *h;
 
   initlock(&bcache.lock, "bcache");
+  for(h = bcache.bucket; h < bcache.bucket+NBUFBUCKET; h++)
+    initlock(&h->lock, "bcache.bucket");
 
-  // Create linked list of buffers
-  bcache.head.prev = &bcache.head;
-  bcache.head.next = &bcache.head;
-  for(b = bcache.buf; b < bcache.buf+NBUF; b++){
-    b->next = bcache.head.next;
-    b->prev = &bcache.head;
-    initsleeplock(&b->lock, "buffer");
-    bcache.head.next->prev = b;
-    bcache.head.next = b;
+  while(bcache.nbuf < NBUF){
+    if(bgrow() < 0)
+      panic("binit");
   }
 }
 
+// Does this CPU hold any of the buffer cache's spinlocks?
+static int
+bholding(void)
+{
+  struct bucket *h;
+  int r;
+
+  push_off();
+  r = holding(&bcache.lock);
+  for(h = bcache.bucket; !r && h < bcache.bucket+NBUFBUCKET; h++)
+    r = holding(&h->lock);
+  pop_off();
+  return r;
+}
+
+// Give back to kalloc the groups of buffers none of which
+// is in use, keeping at least NBUF buffers. Their blocks are
+// clean: bwrite writes through, and the log pins the blocks it
+// has yet to write.
+// Called by kalloc when memory is short, so possibly from
+// inside the buffer cache: it gives nothing back if this CPU
+// already holds a bio lock, rather than take one again or out
+// of order. Buffers held with their sleeplock are in use and
+// never freed.
+// Returns the number of pages freed.
+int
+bshrink(void)
+{
+  struct bgroup *g, **gp, *freed = 0;
+  struct bucket *h[BPERGROUP], *t;
+  struct buf **pp;
+  int i, j, n, busy, nfreed = 0;
+
+  if(bholding())
+    return 0;
+
+  acquire(&bcache.lock);
+  for(gp = &bcache.groups; (g = *gp) != 0 && bcache.nbuf - BPERGROUP >= NBUF; ){
+    // lock the buckets of the group's buffers, in order
+    n = 0;
+    for(i = 0; i < BPERGROUP; i++){
+      t = bhash(g->buf[i].dev, g->buf[i].blockno);
+      for(j = 0; j < n && h[j] != t; j++)
+        ;
+      if(j == n)
+        h[n++] = t;
+    }
+    for(i = 1; i < n; i++){
+      for(j = i; j > 0 && h[j-1] > h[j]; j--){
+        t = h[j-1];
+        h[j-1] = h[j];
+        h[j] = t;
+      }
+    }
+    for(j = 0; j < n; j++)
+      acquire(&h[j]->lock);
+
+    busy = 0;
+    for(i = 0; i < BPERGROUP; i++){
+      if(g->buf[i].refcnt != 0)
+        busy = 1;
+    }
+    if(!busy){
+      for(i = 0; i < BPERGROUP; i++){
+        t = bhash(g->buf[i].dev, g->buf[i].blockno);
+        for(pp = &t->head; *pp != &g->buf[i]; pp = &(*pp)->next)
+          ;
+        *pp = g->buf[i].next;
+      }
+    }
+    for(j = 0; j < n; j++)
+      release(&h[j]->lock);
+
+    if(busy){
+      gp = &g->next;
+      continue;
+    }
+    *gp = g->next;
+    bcache.nbuf -= BPERGROUP;
+    if(bcache.handg == g){
+      bcache.handg = g->next;
+      bcache.hand = 0;
+    }
+    g->next = freed;
+    freed = g;
+  }
+  release(&bcache.lock);
+
+  while((g = freed) != 0){
+    freed = g->next;
+    kfree((void*)g);
+    nfreed++;
+  }
+  return nfreed;
+}
+
+// Find block blockno of dev in bucket h.
+// Caller must hold h->lock.
+static struct buf*
+blookup(struct bucket *h, uint dev, uint blockno)
+{
+  struct buf *b;
+
+  for(b = h->head; b; b = b->next){
+    if(b->dev == dev && b->blockno == blockno)
+      return b;
+  }
+  return 0;
+}
+
 // Look through buffer cache for block on device dev.
 // If not found, allocate a buffer.
 // In either case, return locked buffer.
+// If onlynew, return 0 rather than a cached buffer, so the
+// caller never sleeps for another's buffer, or when taking a
+// buffer would leave too few idle ones.
 static struct buf*
-bget(uint dev, uint blockno)
+bget(uint dev, uint blockno, int onlynew)
 {
-  struct buf *b;
+  struct bucket *h = bhash(dev, blockno), *victimh;
+  struct buf *b, *victim, **pp;
+  int i, nidle;
 
-  acquire(&bcache.lock);
+  acquire(&h->lock);
 
   // Is the block already cached?
-  for(b = bcache.head.next; b != &bcache.head; b = b->next){
-    if(b->dev == dev && b->blockno == blockno){
-      b->refcnt++;
-      release(&bcache.lock);
-      acquiresleep(&b->lock);
-      return b;
+  if((b = blookup(h, dev, blockno)) != 0){
+    if(onlynew){
+      release(&h->lock);
+      return 0;
     }
+    b->refcnt++;
+    release(&h->lock);
+    acquiresleep(&b->lock);
+    return b;
   }
+  release(&h->lock);
+
+  // Not cached. Add buffers rather than recycle one, if the
+  // cache may grow.
+  if(bcache.nbuf + BPERGROUP <= NBUFMAX && knfree() >= NBUFFREE)
+    bgrow();
 
-  // Not cached.
-  // Recycle the least recently used (LRU) unused buffer.
-  for(b = bcache.head.prev; b != &bcache.head; b = b->prev){
-    if(b->refcnt == 0) {
-      b->dev = dev;
-      b->blockno = blockno;
-      b->valid = 0;
-      b->refcnt = 1;
+  // Look again holding bcache.lock, since another miss may
+  // have added the block in the meantime.
+  acquire(&bcache.lock);
+  acquire(&h->lock);
+  if((b = blookup(h, dev, blockno)) != 0){
+    if(onlynew){
+      release(&h->lock);
       release(&bcache.lock);
-      acquiresleep(&b->lock);
-      return b;
+      return 0;
+    }
+    b->refcnt++;
+    release(&h->lock);
+    release(&bcache.lock);
+    acquiresleep(&b->lock);
+    return b;
+  }
+  release(&h->lock);
+
+  // Recycle the first unused buffer the clock hand finds that
+  // was not released since the hand last passed, keeping its
+  // bucket locked until it is taken out. Two sweeps find one if
+  // any buffer is unused. Holding bcache.lock keeps the block
+  // numbers, and so the buckets, of all buffers from changing.
+  // Prefetches leave enough idle buffers for an FS operation:
+  // they take one only after the hand has passed more than
+  // MAXOPBLOCKS idle buffers, counted over the first sweep.
+  victim = 0;
+  victimh = 0;
+  nidle = 0;
+  for(i = 0; i < 2*bcache.nbuf; i++){
+    if(onlynew && i == bcache.nbuf && nidle <= MAXOPBLOCKS)
+      break;
+    if(bcache.handg == 0){
+      bcache.handg = bcache.groups;
+      bcache.hand = 0;
+    }
+    b = &bcache.handg->buf[bcache.hand];
+    if(++bcache.hand == BPERGROUP){
+      bcache.handg = bcache.handg->next;
+      bcache.hand = 0;
     }
+    victimh = bhash(b->dev, b->blockno);
+    acquire(&victimh->lock);
+    if(b->refcnt == 0){
+      if(i < bcache.nbuf)
+        nidle++;
+      if(!b->used && (!onlynew || nidle > MAXOPBLOCKS)){
+        victim = b;
+        break;
+      }
+      b->used = 0;
+    }
+    release(&victimh->lock);
+  }
+  if(victim == 0 && onlynew){
+    release(&bcache.lock);
+    return 0;
   }
-  panic("bget: no buffers");
+  if(victim == 0)
+    panic("bget: no buffers");
+
+  // move it to the bucket of its new block
+  for(pp = &victimh->head; *pp != victim; pp = &(*pp)->next)
+    ;
+  *pp = victim->next;
+  release(&victimh->lock);
+
+  victim->dev = dev;
+  victim->blockno = blockno;
+  victim->valid = 0;
+  victim->refcnt = 1;
+  acquire(&h->lock);
+  victim->next = h->head;
+  h->head = victim;
+  release(&h->lock);
+  release(&bcache.lock);
+  acquiresleep(&victim->lock);
+  return victim;
 }
 
 // Return a locked buf with the contents of the indicated block.
@@ -94,60 +349,152 @@ bread(uint dev, uint blockno)
 {
   struct buf *b;
 
-  b = bget(dev, blockno);
-  if(!b->valid) {
-    virtio_disk_rw(b, 0);
-    b->valid = 1;
-  }
+  b = bread_async(dev, blockno);
+  bwait(b);
+  return b;
+}
+
+// Like bread, but only start reading the block if it is not
+// cached; call bwait before using the contents. Reads of
+// several blocks can be in flight at once this way.
+struct buf*
+bread_async(uint dev, uint blockno)
+{
+  struct buf *b;
+
+  b = bget(dev, blockno, 0);
+  if(!b->valid)
+    bstart(&b, 1, 0);
   return b;
 }
 
 // Write b's contents to disk.  Must be locked.
 void
 bwrite(struct buf *b)
+{
+  bwrite_async(b);
+  bwait(b);
+}
+
+// Start writing b's contents to disk.  Must be locked, and
+// stay locked until bwait returns.
+void
+bwrite_async(struct buf *b)
+{
+  bstart(&b, 1, 1);
+}
+
+// Start reading (write=0) or writing the locked buffers
+// bufs[0..n), without waiting; a read skips the buffers whose
+// contents are valid. Each run of consecutive blocks goes to
+// the disk as one request. Call bwait on each buffer before
+// using or releasing it.
+void
+bstart(struct buf **bufs, int n, int write)
+{
+  int i, j;
+
+  for(i = 0; i < n; i = j){
+    if(!holdingsleep(&bufs[i]->lock))
+      panic("bstart");
+    j = i + 1;
+    if(!write && bufs[i]->valid)
+      continue;
+    while(j < n && j - i < MAXRUN && bufs[j]->dev == bufs[i]->dev &&
+          bufs[j]->blockno == bufs[j-1]->blockno + 1 &&
+          (write || !bufs[j]->valid))
+      j++;
+    virtio_disk_start(&bufs[i], j - i, write);
+  }
+}
+
+// Called by the disk interrupt when a read started by
+// bprefetch is done: release the buffer for its owner.
+// The driver no longer holds vdisk_lock.
+static void
+bdone(struct buf *b)
+{
+  struct bucket *h = bhash(b->dev, b->blockno);
+
+  b->done = 0;
+  b->valid = 1;
+  releasesleep(&b->lock);
+  acquire(&h->lock);
+  b->refcnt--;
+  if(b->refcnt == 0)
+    b->used = 1;
+  release(&h->lock);
+}
+
+// Start reading those of the n blocks blocknos[] of dev that
+// are not cached, without waiting; a later bread of one waits
+// for its read to finish. Runs of consecutive blocks go to the
+// disk as one request. Never sleeps for another's buffer.
+void
+bprefetch(uint dev, uint *blocknos, int n)
+{
+  struct buf *bufs[MAXRUN], *b;
+  int i, k = 0;
+
+  for(i = 0; i < n; i++){
+    if((b = bget(dev, blocknos[i], 1)) == 0)
+      continue;
+    b->done = bdone;
+    bufs[k++] = b;
+    if(k == MAXRUN){
+      bstart(bufs, k, 0);
+      k = 0;
+    }
+  }
+  bstart(bufs, k, 0);
+}
+
+// Wait for the read or write started on b to finish.
+void
+bwait(struct buf *b)
 {
   if(!holdingsleep(&b->lock))
-    panic("bwrite");
-  virtio_disk_rw(b, 1);
+    panic("bwait");
+  virtio_disk_wait(b);
+  b->valid = 1;
 }
 
 // Release a locked buffer.
-// Move to the head of the most-recently-used list.
+// Mark it used, so the clock hand passes it over once.
 void
 brelse(struct buf *b)
 {
+  struct bucket *h;
+
   if(!holdingsleep(&b->lock))
     panic("brelse");
 
   releasesleep(&b->lock);
 
-  acquire(&bcache.lock);
+  h = bhash(b->dev, b->blockno);
+  acquire(&h->lock);
   b->refcnt--;
   if (b->refcnt == 0) {
     // no one is waiting for it.
-    b->next->prev = b->prev;
-    b->prev->next = b->next;
-    b->next = bcache.head.next;
-    b->prev = &bcache.head;
-    bcache.head.next->prev = b;
-    bcache.head.next = b;
+    b->used = 1;
   }
-  
-  release(&bcache.lock);
+  release(&h->lock);
 }
 
 void
 bpin(struct buf *b) {
-  acquire(&bcache.lock);
+  struct bucket *h = bhash(b->dev, b->blockno);
+
+  acquire(&h->lock);
   b->refcnt++;
-  release(&bcache.lock);
+  release(&h->lock);
 }
 
 void
 bunpin(struct buf *b) {
-  acquire(&bcache.lock);
+  struct bucket *h = bhash(b->dev, b->blockno);
+
+  acquire(&h->lock);
   b->refcnt--;
-  release(&bcache.lock);
+  release(&h->lock);
 }
-
-
@@ -5,8 +5,10 @@ struct buf {
   uint blockno;
   struct sleeplock lock;
   uint refcnt;
-  struct buf *prev; // LRU cache list
-  struct buf *next;
+  int used;    // released since the clock hand last passed
+  struct buf *next; // hash bucket chain
+  struct buf *qnext; // next buf of the same disk request
+  void (*done)(struct buf*); // if set, called by the disk interrupt when done
   uchar data[BSIZE];
 };
 
@@ -10,16 +10,24 @@ struct pipe;
 struct proc;
 struct spinlock;
 struct sleeplock;
+struct spawn_action;
 struct stat;
 struct superblock;
+struct vm_area;
 
 // bio.c
 void            binit(void);
 struct buf*     bread(uint, uint);
 void            brelse(struct buf*);
 void            bwrite(struct buf*);
+struct buf*     bread_async(uint, uint);
+void            bwrite_async(struct buf*);
+void            bwait(struct buf*);
+void            bstart(struct buf**, int, int);
+void            bprefetch(uint, uint*, int);
 void            bpin(struct buf*);
 void            bunpin(struct buf*);
+int             bshrink(void);
 
 // console.c
 void            consoleinit(void);
@@ -28,6 +36,7 @@ void            consputc(int);
 
 // exec.c
 int             exec(char*, char**);
+int             execproc(struct proc*, char*, char**);
 
 // file.c
 struct file*    filealloc(void);
@@ -44,6 +53,7 @@ int             dirlink(struct inode*, char*, uint);
 struct inode*   dirlookup(struct inode*, char*, uint*);
 struct inode*   ialloc(uint, short);
 struct inode*   idup(struct inode*);
+struct inode*   iget(uint, uint);
 void            iinit();
 void            ilock(struct inode*);
 void            iput(struct inode*);
@@ -54,6 +64,7 @@ int             namecmp(const char*, const char*);
 struct inode*   namei(char*);
 struct inode*   nameiparent(char*, char*);
 int             readi(struct inode*, int, uint64, uint, uint);
+void            ireadahead(struct inode*, uint, uint);
 void            stati(struct inode*, struct stat*);
 int             writei(struct inode*, int, uint64, uint, uint);
 void            itrunc(struct inode*);
@@ -66,6 +77,13 @@ void            ramdiskrw(struct buf*);
 // kalloc.c
 void*           kalloc(void);
 void            kfree(void *);
+void            kdup(void *);
+void*           kalloc_zeroed(void);
+int             kzerofill(void);
+void*           kalloc_pages(int);
+void            kfree_pages(void *, int);
+int             knfree(void);
+int             krefs(void *);
 void            kinit(void);
 
 // log.c
@@ -74,6 +92,18 @@ void            log_write(struct buf*);
 void            begin_op(void);
 void            end_op(void);
 
+// pagecache.c
+void            pcinit(void);
+char*           pcget(struct inode*, uint);
+void            pcput(struct inode*, uint);
+int             pcreclaim(void);
+void            pcwrite(struct inode*, uint, char*, uint, char*);
+void            pctrunc(struct inode*);
+void            pcsetdirty(struct inode*, uint);
+int             pcisdirty(struct inode*, uint);
+int             pcclrdirty(struct inode*, uint);
+void            pcflush(void);
+
 // pipe.c
 int             pipealloc(struct file**, struct file**);
 void            pipeclose(struct pipe*, int);
@@ -89,12 +119,12 @@ void            printfinit(void);
 int             cpuid(void);
 void            exit(int);
 int             fork(void);
+int             spawn(char*, char**, struct spawn_action*, int);
 int             growproc(int);
 void            proc_mapstacks(pagetable_t);
 pagetable_t     proc_pagetable(struct proc *);
-void            proc_freepagetable(pagetable_t, uint64);
-struct vm_area;
-void            proc_free_vmareas(pagetable_t pagetable, struct vm_area * areas);
+void            proc_freepagetable(pagetable_t, uint64, uint64, uint64);
+void            proc_free_vmareas(struct proc *, pagetable_t);
 int             kill(int);
 int             killed(struct proc*);
 void            setkilled(struct proc*);
@@ -152,8 +182,8 @@ int             fetchaddr(uint64, uint64*);
 void            syscall();
 
 // sysfile.c
-struct vm_area;
 void            clear_vm_area(struct vm_area * area, pagetable_t pagetable);
+void            mmap_prefault(uint64, uint64, int);
 
 // trap.c
 extern uint     ticks;
@@ -170,6 +200,7 @@ void            uartputc_sync(int);
 int             uartgetc(void);
 
 // vm.c
+extern uint64   zeropage;
 void            kvminit(void);
 void            kvminithart(void);
 void            kvmmap(pagetable_t, uint64, uint64, uint64, int);
@@ -178,15 +209,24 @@ pagetable_t     uvmcreate(void);
 void            uvmfirst(pagetable_t, uchar *, uint);
 uint64          uvmalloc(pagetable_t, uint64, uint64, int);
 uint64          uvmdealloc(pagetable_t, uint64, uint64);
-int             uvmcopy(pagetable_t, pagetable_t, uint64);
-void            uvmfree(pagetable_t, uint64);
+int             uvmcopy(pagetable_t, pagetable_t, uint64, uint64, uint64);
+int             uvmcopyrange(pagetable_t, pagetable_t, uint64, uint64);
+int             uvmiscow(pagetable_t, uint64);
+int             uvmlazy(struct proc*, uint64);
+int             uvmlazysuper(pagetable_t, uint64, uint64, uint64, int);
+int             uvmsplit(pagetable_t, uint64);
+int             mapsuperpage(pagetable_t, uint64, uint64, int);
+int             uvmcow(pagetable_t, uint64);
+void            uvmfree(pagetable_t, uint64, uint64, uint64);
 void            uvmunmap(pagetable_t, uint64, uint64, int);
+void            uvmunmaplazy(pagetable_t, uint64, uint64, int);
+void            uvmunmapproc(pagetable_t, uint64, uint64, uint64, uint64);
 void            uvmclear(pagetable_t, uint64);
 pte_t *         walk(pagetable_t, uint64, int);
 uint64          walkaddr(pagetable_t, uint64);
-int             copyout(pagetable_t, uint64, char *, uint64);
-int             copyin(pagetable_t, char *, uint64, uint64);
-int             copyinstr(pagetable_t, char *, uint64, uint64);
+int             copyout(pagetable_t, uint64, char *, uint64, int);
+int             copyin(pagetable_t, char *, uint64, uint64, int);
+int             copyinstr(pagetable_t, char *, uint64, uint64, int);
 #if defined(LAB_PGTBL) || defined(SOL_MMAP)
 void            vmprint(pagetable_t);
 #endif
@@ -194,6 +234,20 @@ void            vmprint(pagetable_t);
 pte_t*          pgpte(pagetable_t, uint64);
 #endif
 
+// vma.c
+void            vmainit(void);
+struct vm_area* vma_alloc(void);
+void            vma_free(struct vm_area*);
+struct vm_area* vma_find(struct proc*, uint64);
+struct vm_area* vma_next(struct proc*, uint64);
+int             vma_range_free(struct proc*, uint64, uint64);
+uint64          vma_hole(struct proc*, uint64, uint64, uint64);
+int             vma_initindex(struct proc*);
+int             vma_insert(struct proc*, struct vm_area*);
+void            vma_remove(struct proc*, struct vm_area*);
+struct vm_area* vma_split(struct proc*, struct vm_area*, uint64);
+void            vma_freeindex(struct proc*);
+
 // plic.c
 void            plicinit(void);
 void            plicinithart(void);
@@ -203,6 +257,8 @@ void            plic_complete(int);
 // virtio_disk.c
 void            virtio_disk_init(void);
 void            virtio_disk_rw(struct buf *, int);
+void            virtio_disk_start(struct buf **, int, int);
+void            virtio_disk_wait(struct buf *);
 void            virtio_disk_intr(void);
 
 // number of elements in fixed-size array
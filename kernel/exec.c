@@ -6,6 +6,10 @@
 #include "proc.h"
 #include "defs.h"
 #include "elf.h"
+#include "fs.h"
+#include "sleeplock.h"
+#include "file.h"
+#include "fcntl.h"
 
 static int loadseg(pde_t *, uint64, struct inode *, uint, uint);
 
@@ -19,17 +23,22 @@ int flags2perm(int flags)
     return perm;
 }
 
+// Replace the user image of p, the current process or a new
+// one being built by spawn(), with the program path.
+// Returns argc, or -1 leaving p unchanged.
 int
-exec(char *path, char **argv)
+execproc(struct proc *p, char *path, char **argv)
 {
   char *s, *last;
-  int i, off;
+  int i, off, lazy, nload = 0, nseg = 0;
   uint64 argc, sz = 0, sp, ustack[MAXARG], stackbase;
+  uint64 stack = 0, heap = 0;
   struct elfhdr elf;
   struct inode *ip;
   struct proghdr ph;
   pagetable_t pagetable = 0, oldpagetable;
-  struct proc *p = myproc();
+  struct file *f = 0;
+  struct vm_area *seg[MAXSEG], *a;
 
   begin_op();
 
@@ -49,7 +58,11 @@ exec(char *path, char **argv)
   if((pagetable = proc_pagetable(p)) == 0)
     goto bad;
 
-  // Load program into memory.
+  // Map the segments from the file, to be paged in as they are
+  // used (see mmap_load_instr()), if they are laid out in the
+  // file as in memory: page aligned, in order, sharing no page.
+  // Otherwise read them in now.
+  lazy = 1;
   for(i=0, off=elf.phoff; i<elf.phnum; i++, off+=sizeof(ph)){
     if(readi(ip, 0, (uint64)&ph, off, sizeof(ph)) != sizeof(ph))
       goto bad;
@@ -61,6 +74,54 @@ exec(char *path, char **argv)
       goto bad;
     if(ph.vaddr % PGSIZE != 0)
       goto bad;
+    if(ph.vaddr + ph.memsz > MMAPTOP)
+      goto bad;
+    if(ph.off % PGSIZE != 0 || ph.vaddr < sz || nload >= MAXSEG)
+      lazy = 0;
+    sz = PGROUNDUP(ph.vaddr + ph.memsz);
+    nload++;
+  }
+  sz = 0;
+  if(lazy && nload > 0){
+    if(vma_initindex(p) < 0 || (f = filealloc()) == 0){
+      lazy = 0;
+    } else {
+      f->type = FD_INODE;
+      f->ip = idup(ip);
+      f->readable = 1;
+      f->writable = 0;
+      f->off = 0;
+    }
+  }
+
+  // Load program into memory.
+  for(i=0, off=elf.phoff; i<elf.phnum; i++, off+=sizeof(ph)){
+    if(readi(ip, 0, (uint64)&ph, off, sizeof(ph)) != sizeof(ph))
+      goto bad;
+    if(ph.type != ELF_PROG_LOAD)
+      continue;
+    if(lazy){
+      if(ph.memsz == 0)
+        continue;
+      if((a = vma_alloc()) == 0)
+        goto bad;
+      seg[nseg++] = a;
+      a->start_addr = ph.vaddr;
+      a->length = PGROUNDUP(ph.memsz);
+      a->prot = PROT_READ;
+      if(ph.flags & ELF_PROG_FLAG_EXEC)
+        a->prot |= PROT_EXEC;
+      if(ph.flags & ELF_PROG_FLAG_WRITE)
+        a->prot |= PROT_WRITE;
+      a->flags = MAP_PRIVATE;
+      a->fptr = filedup(f);
+      a->offset = ph.off;
+      a->file_end = ph.off + ph.filesz;
+      a->advice = MADV_NORMAL;
+      a->image = 1;
+      sz = ph.vaddr + ph.memsz;
+      continue;
+    }
     uint64 sz1;
     if((sz1 = uvmalloc(pagetable, sz, ph.vaddr + ph.memsz, flags2perm(ph.flags))) == 0)
       goto bad;
@@ -71,9 +132,13 @@ exec(char *path, char **argv)
   iunlockput(ip);
   end_op();
   ip = 0;
+  if(f){
+    // the segments hold their own references
+    fileclose(f);
+    f = 0;
+  }
 
-  p = myproc();
-  uint64 oldsz = p->sz;
+  uint64 oldsz = p->sz, oldstack = p->stack, oldheap = p->heap;
 
   // Allocate some pages at the next page boundary.
   // Make the first inaccessible as a stack guard.
@@ -83,7 +148,9 @@ exec(char *path, char **argv)
   if((sz1 = uvmalloc(pagetable, sz, sz + (USERSTACK+1)*PGSIZE, PTE_W)) == 0)
     goto bad;
   sz = sz1;
-  uvmclear(pagetable, sz-(USERSTACK+1)*PGSIZE);
+  stack = sz-(USERSTACK+1)*PGSIZE;
+  heap = sz;
+  uvmclear(pagetable, stack);
   sp = sz;
   stackbase = sp - USERSTACK*PGSIZE;
 
@@ -95,7 +162,7 @@ exec(char *path, char **argv)
     sp -= sp % 16; // riscv sp must be 16-byte aligned
     if(sp < stackbase)
       goto bad;
-    if(copyout(pagetable, sp, argv[argc], strlen(argv[argc]) + 1) < 0)
+    if(copyout(pagetable, sp, argv[argc], strlen(argv[argc]) + 1, 0) < 0)
       goto bad;
     ustack[argc] = sp;
   }
@@ -106,7 +173,7 @@ exec(char *path, char **argv)
   sp -= sp % 16;
   if(sp < stackbase)
     goto bad;
-  if(copyout(pagetable, sp, (char *)ustack, (argc+1)*sizeof(uint64)) < 0)
+  if(copyout(pagetable, sp, (char *)ustack, (argc+1)*sizeof(uint64), 0) < 0)
     goto bad;
 
   // arguments to user main(argc, argv)
@@ -124,23 +191,42 @@ exec(char *path, char **argv)
   oldpagetable = p->pagetable;
   p->pagetable = pagetable;
   p->sz = sz;
+  p->stack = stack;
+  p->heap = heap;
   p->trapframe->epc = elf.entry;  // initial program counter = main
   p->trapframe->sp = sp; // initial stack pointer
-  proc_free_vmareas(oldpagetable, p->vm_areas);
-  proc_freepagetable(oldpagetable, oldsz);
+  proc_free_vmareas(p, oldpagetable);
+  proc_freepagetable(oldpagetable, oldstack, oldheap, oldsz);
+  for(i = 0; i < nseg; i++){
+    // the index exists and is empty, this cannot fail
+    if(vma_insert(p, seg[i]) < 0)
+      panic("exec: segments");
+  }
 
   return argc; // this ends up in a0, the first argument to main(argc, argv)
 
  bad:
   if(pagetable)
-    proc_freepagetable(pagetable, sz);
+    proc_freepagetable(pagetable, stack, heap, sz);
   if(ip){
     iunlockput(ip);
     end_op();
   }
+  for(i = 0; i < nseg; i++){
+    fileclose(seg[i]->fptr);
+    vma_free(seg[i]);
+  }
+  if(f)
+    fileclose(f);
   return -1;
 }
 
+int
+exec(char *path, char **argv)
+{
+  return execproc(myproc(), path, argv);
+}
+
 // Load a program segment into pagetable at virtual address va.
 // va must be page-aligned
 // and the pages from va to va+sz must already be mapped.
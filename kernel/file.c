@@ -94,13 +94,47 @@ filestat(struct file *f, uint64 addr)
     ilock(f->ip);
     stati(f->ip, &st);
     iunlock(f->ip);
-    if(copyout(p->pagetable, addr, (char *)&st, sizeof(st)) < 0)
+    if(copyout(p->pagetable, addr, (char *)&st, sizeof(st), 1) < 0)
       return -1;
     return 0;
   }
   return -1;
 }
 
+// Start reading the blocks after a read of f from off, so
+// that a sequential reader finds them cached. The window
+// doubles with each read that carries on where the last one
+// ended, up to RAMAX blocks; any other read (the offset was
+// moved by a write) closes it. More is started only once the
+// reader is halfway through what was read ahead.
+// Caller must hold f->ip->lock.
+static void
+readahead(struct file *f, uint off)
+{
+  uint bn, end;
+
+  if(off != f->ra_next){
+    f->ra_win = 0;
+    f->ra_end = 0;
+  } else if(f->ra_win == 0){
+    f->ra_win = RAMIN;
+  } else if(f->ra_win < RAMAX){
+    f->ra_win *= 2;
+  }
+  f->ra_next = f->off;
+  if(f->ra_win == 0)
+    return;
+
+  bn = (f->off + BSIZE - 1) / BSIZE;
+  end = bn + f->ra_win;
+  if(f->ra_end < bn)
+    f->ra_end = bn;
+  if(f->ra_end - bn > f->ra_win / 2)
+    return;
+  ireadahead(f->ip, f->ra_end, end);
+  f->ra_end = end;
+}
+
 // Read from file f.
 // addr is a user virtual address.
 int
@@ -111,16 +145,33 @@ fileread(struct file *f, uint64 addr, int n)
   if(f->readable == 0)
     return -1;
 
+  // fault in the destination first: pipes, devices and readi
+  // copy holding locks, so they cannot (see uvmtouch). only
+  // what the read can return is faulted in, a large buffer
+  // is not allocated for a short read.
   if(f->type == FD_PIPE){
+    mmap_prefault(addr, n < PIPESIZE ? n : PIPESIZE, 1);
     r = piperead(f->pipe, addr, n);
   } else if(f->type == FD_DEVICE){
     if(f->major < 0 || f->major >= NDEV || !devsw[f->major].read)
       return -1;
+    // the console returns at most a line of input
+    mmap_prefault(addr, n < PGSIZE ? n : PGSIZE, 1);
     r = devsw[f->major].read(1, addr, n);
   } else if(f->type == FD_INODE){
     ilock(f->ip);
-    if((r = readi(f->ip, 1, addr, f->off, n)) > 0)
+    if(f->off >= f->ip->size)
+      n = 0;
+    else if(n > f->ip->size - f->off)
+      n = f->ip->size - f->off;
+    iunlock(f->ip);
+    mmap_prefault(addr, n, 1);
+    // read no more than was faulted in, should the file grow
+    ilock(f->ip);
+    if((r = readi(f->ip, 1, addr, f->off, n)) > 0){
       f->off += r;
+      readahead(f, f->off - r);
+    }
     iunlock(f->ip);
   } else {
     panic("fileread");
@@ -139,11 +190,24 @@ filewrite(struct file *f, uint64 addr, int n)
   if(f->writable == 0)
     return -1;
 
+  // fault in the source first, as fileread does, a piece at a
+  // time for pipes and files.
   if(f->type == FD_PIPE){
-    ret = pipewrite(f->pipe, addr, n);
+    while(ret < n){
+      int n1 = n - ret < PIPESIZE ? n - ret : PIPESIZE;
+      mmap_prefault(addr + ret, n1, 0);
+      if((r = pipewrite(f->pipe, addr + ret, n1)) < 0){
+        ret = -1;
+        break;
+      }
+      ret += r;
+      if(r != n1)
+        break;
+    }
   } else if(f->type == FD_DEVICE){
     if(f->major < 0 || f->major >= NDEV || !devsw[f->major].write)
       return -1;
+    mmap_prefault(addr, n, 0);
     ret = devsw[f->major].write(1, addr, n);
   } else if(f->type == FD_INODE){
     // write a few blocks at a time to avoid exceeding
@@ -159,6 +223,7 @@ filewrite(struct file *f, uint64 addr, int n)
       if(n1 > max)
         n1 = max;
 
+      mmap_prefault(addr + i, n1, 0);
       begin_op();
       ilock(f->ip);
       if ((r = writei(f->ip, 1, addr + i, f->off, n1)) > 0)
@@ -6,6 +6,9 @@ struct file {
   struct pipe *pipe; // FD_PIPE
   struct inode *ip;  // FD_INODE and FD_DEVICE
   uint off;          // FD_INODE
+  uint ra_next;      // FD_INODE: offset a sequential read starts at
+  uint ra_win;       // FD_INODE: readahead window in blocks, 0 if off
+  uint ra_end;       // FD_INODE: block readahead has been started up to
   short major;       // FD_DEVICE
 };
 
@@ -189,7 +189,6 @@ iinit()
   }
 }
 
-static struct inode* iget(uint dev, uint inum);
 
 // Allocate an inode on device dev.
 // Mark it as allocated by  giving it type type.
@@ -243,7 +242,7 @@ iupdate(struct inode *ip)
 // Find the inode with number inum on device dev
 // and return the in-memory copy. Does not lock
 // the inode and does not read it from disk.
-static struct inode*
+struct inode*
 iget(uint dev, uint inum)
 {
   struct inode *ip, *empty;
@@ -450,6 +449,7 @@ itrunc(struct inode *ip)
 
   ip->size = 0;
   iupdate(ip);
+  pctrunc(ip);
 }
 
 // Copy stat information from inode.
@@ -464,6 +464,39 @@ stati(struct inode *ip, struct stat *st)
   st->size = ip->size;
 }
 
+// Start reading the blocks bn up to end of ip, at most
+// MAXRUN of them, that are not cached. A single block is
+// left for bread.
+// Caller must hold ip->lock.
+static void
+iprefetch(struct inode *ip, uint bn, uint end)
+{
+  uint addrs[MAXRUN];
+  int n;
+
+  if(end - bn < 2)
+    return;
+  for(n = 0; n < MAXRUN && bn < end; n++, bn++){
+    if((addrs[n] = bmap(ip, bn)) == 0)
+      break;
+  }
+  bprefetch(ip->dev, addrs, n);
+}
+
+// Start reading blocks [bn, end) of ip, or those of them inside
+// the file, without waiting for them.
+// Caller must hold ip->lock.
+void
+ireadahead(struct inode *ip, uint bn, uint end)
+{
+  uint nblocks = (ip->size + BSIZE - 1) / BSIZE;
+
+  if(end > nblocks)
+    end = nblocks;
+  for(; bn < end; bn += MAXRUN)
+    iprefetch(ip, bn, end);
+}
+
 // Read data from inode.
 // Caller must hold ip->lock.
 // If user_dst==1, then dst is a user virtual address;
@@ -480,6 +513,10 @@ readi(struct inode *ip, int user_dst, uint64 dst, uint off, uint n)
     n = ip->size - off;
 
   for(tot=0; tot<n; tot+=m, off+=m, dst+=m){
+    // start reading the next MAXRUN blocks, so that adjacent
+    // ones go to the disk as one request
+    if(tot == 0 || (off/BSIZE) % MAXRUN == 0)
+      iprefetch(ip, off/BSIZE, (off + n - tot + BSIZE - 1)/BSIZE);
     uint addr = bmap(ip, off/BSIZE);
     if(addr == 0)
       break;
@@ -524,6 +561,8 @@ writei(struct inode *ip, int user_src, uint64 src, uint off, uint n)
       break;
     }
     log_write(bp);
+    // mapped pages of the file must not go stale.
+    pcwrite(ip, off, (char*)bp->data + (off % BSIZE), m, user_src ? 0 : (char*)src);
     brelse(bp);
   }
 
@@ -1,6 +1,32 @@
 // Physical memory allocator, for user processes,
 // kernel stacks, page-table pages,
 // and pipe buffers. Allocates whole 4096-byte pages.
+//
+// Each page has a reference count so that copy-on-write
+// fork can share user pages: kalloc returns a page with one
+// reference, kdup adds one, and kfree frees the page when
+// the last reference is dropped.
+//
+// Underneath is a buddy allocator: free memory is kept in
+// blocks of 2^order pages, aligned to their size, for orders
+// 0..MAXORDER. An allocation splits a bigger block if needed,
+// and a freed block is merged with its buddy whenever the buddy
+// is free too, so kalloc_pages() can hand out physically
+// contiguous memory.
+//
+// Single free pages are also kept on per-CPU lists, so that
+// CPUs do not all contend for one lock. A CPU whose list runs
+// empty takes a batch of pages from the buddy allocator, or
+// else steals half of another CPU's; one whose list grows too
+// long gives a batch back.
+//
+// Idle CPUs keep a pool of pages zeroed ahead of time for
+// kalloc_zeroed(), so most callers that need a clean page do
+// not clear it themselves.
+//
+// Building with KJUNK=1 fills pages with junk as they are
+// allocated and freed, to catch uses of uninitialized memory
+// and dangling references.
 
 #include "types.h"
 #include "param.h"
@@ -18,48 +44,428 @@ struct run {
   struct run *next;
 };
 
-struct {
+struct kfreelist {
   struct spinlock lock;
   struct run *freelist;
+  int nfree;
+};
+
+// a free block of the buddy allocator
+struct block {
+  struct block *next;
+  struct block *prev;
+};
+
+#define NPAGE ((PHYSTOP - KERNBASE) / PGSIZE)
+
+struct {
+  struct spinlock lock;
+  struct block free[MAXORDER+1];  // list heads, by order
+  char order[NPAGE];              // order of the free block at a page, or -1
+  uint64 base;                    // first page the allocator manages
+  int nfree;                      // free pages in all blocks
+} buddy;
+
+struct {
+  struct kfreelist cpu[NCPU];     // per-CPU caches
+  struct kfreelist zeroed;        // pages already filled with zeros
+  int ref[NPAGE];                 // references to each page
 } kmem;
 
+#define PA2REF(pa) (((uint64)(pa) - KERNBASE) / PGSIZE)
+#define PA2PG(pa)  PA2REF(pa)
+
 void
 kinit()
 {
-  initlock(&kmem.lock, "kmem");
+  int i;
+
+  initlock(&buddy.lock, "kmem");
+  for(i = 0; i <= MAXORDER; i++)
+    buddy.free[i].next = buddy.free[i].prev = &buddy.free[i];
+  for(i = 0; i < NPAGE; i++)
+    buddy.order[i] = -1;
+  for(i = 0; i < NCPU; i++)
+    initlock(&kmem.cpu[i].lock, "kmem_cpu");
+  initlock(&kmem.zeroed.lock, "kmem_zeroed");
   freerange(end, (void*)PHYSTOP);
 }
 
+static void buddy_free(uint64 pa, int order);
+
 void
 freerange(void *pa_start, void *pa_end)
 {
   char *p;
   p = (char*)PGROUNDUP((uint64)pa_start);
-  for(; p + PGSIZE <= (char*)pa_end; p += PGSIZE)
-    kfree(p);
+  buddy.base = (uint64)p;
+  acquire(&buddy.lock);
+  for(; p + PGSIZE <= (char*)pa_end; p += PGSIZE){
+    kmem.ref[PA2REF(p)] = 0;
+    buddy_free((uint64)p, 0);
+  }
+  release(&buddy.lock);
+}
+
+static void
+block_push(int order, uint64 pa)
+{
+  struct block *b = (struct block*)pa;
+  struct block *h = &buddy.free[order];
+
+  b->next = h->next;
+  b->prev = h;
+  h->next->prev = b;
+  h->next = b;
+  buddy.order[PA2PG(pa)] = order;
+  buddy.nfree += 1 << order;
+}
+
+static void
+block_unlink(uint64 pa)
+{
+  struct block *b = (struct block*)pa;
+
+  b->prev->next = b->next;
+  b->next->prev = b->prev;
+  buddy.nfree -= 1 << buddy.order[PA2PG(pa)];
+  buddy.order[PA2PG(pa)] = -1;
 }
 
-// Free the page of physical memory pointed at by pa,
-// which normally should have been returned by a
-// call to kalloc().  (The exception is when
-// initializing the allocator; see kinit above.)
+// Free the block of 2^order pages at pa, merging it with
+// its buddy as long as the buddy is free and whole.
+// Caller must hold buddy.lock.
+static void
+buddy_free(uint64 pa, int order)
+{
+  uint64 b;
+
+  while(order < MAXORDER){
+    b = pa ^ ((uint64)PGSIZE << order);
+    if(b < buddy.base || b + ((uint64)PGSIZE << order) > PHYSTOP)
+      break;
+    if(buddy.order[PA2PG(b)] != order)
+      break;
+    block_unlink(b);
+    if(b < pa)
+      pa = b;
+    order++;
+  }
+  block_push(order, pa);
+}
+
+// Allocate a block of 2^order pages, splitting a bigger one
+// if there is no free block of that order.
+// Returns 0 if there is none.
+// Caller must hold buddy.lock.
+static uint64
+buddy_alloc(int order)
+{
+  uint64 pa;
+  int k;
+
+  for(k = order; k <= MAXORDER; k++){
+    if(buddy.free[k].next != &buddy.free[k])
+      break;
+  }
+  if(k > MAXORDER)
+    return 0;
+  pa = (uint64)buddy.free[k].next;
+  block_unlink(pa);
+  while(k > order){
+    k--;
+    block_push(k, pa + ((uint64)PGSIZE << k));
+  }
+  return pa;
+}
+
+// Take up to n pages off the front of l.
+// Returns them as a chain, and their number in *n.
+// Caller must hold l->lock.
+static struct run*
+ktake(struct kfreelist *l, int *n)
+{
+  struct run *head, *r;
+  int i;
+
+  head = l->freelist;
+  r = 0;
+  for(i = 0; i < *n && l->freelist; i++){
+    r = l->freelist;
+    l->freelist = r->next;
+  }
+  if(r)
+    r->next = 0;
+  l->nfree -= i;
+  *n = i;
+  return i > 0 ? head : 0;
+}
+
+// Put the chain of n pages onto the front of l.
+// Caller must hold l->lock.
+static void
+kput(struct kfreelist *l, struct run *chain, int n)
+{
+  struct run *r;
+
+  if(chain == 0)
+    return;
+  for(r = chain; r->next; r = r->next)
+    ;
+  r->next = l->freelist;
+  l->freelist = chain;
+  l->nfree += n;
+}
+
+// Give a chain of single pages back to the buddy allocator.
+static void
+kgiveback(struct run *chain)
+{
+  struct run *r;
+
+  acquire(&buddy.lock);
+  while((r = chain) != 0){
+    chain = r->next;
+    buddy_free((uint64)r, 0);
+  }
+  release(&buddy.lock);
+}
+
+// Refill the list of CPU id, which is empty: take a batch
+// from the buddy allocator, or else half of another CPU's pages.
+// Returns one of the pages, or 0 if there are none anywhere.
+// Holds one lock at a time, so CPUs stealing from each
+// other cannot deadlock.
+static struct run*
+krefill(int id)
+{
+  struct run *chain = 0, *r;
+  uint64 pa;
+  int i, n;
+
+  acquire(&buddy.lock);
+  for(n = 0; n < KBATCH && (pa = buddy_alloc(0)) != 0; n++){
+    r = (struct run*)pa;
+    r->next = chain;
+    chain = r;
+  }
+  release(&buddy.lock);
+
+  for(i = 0; chain == 0 && i < NCPU; i++){
+    if(i == id)
+      continue;
+    acquire(&kmem.cpu[i].lock);
+    n = (kmem.cpu[i].nfree + 1) / 2;
+    chain = ktake(&kmem.cpu[i], &n);
+    release(&kmem.cpu[i].lock);
+  }
+  if(chain == 0)
+    return 0;
+
+  if(chain->next){
+    acquire(&kmem.cpu[id].lock);
+    kput(&kmem.cpu[id], chain->next, n - 1);
+    release(&kmem.cpu[id].lock);
+  }
+  return chain;
+}
+
+// Drop a reference to the page of physical memory pointed
+// at by pa, which normally should have been returned by a
+// call to kalloc() or kalloc_pages().
+// The page is freed when no references are left.
 void
 kfree(void *pa)
 {
-  struct run *r;
+  struct run *r, *chain = 0;
+  struct kfreelist *l;
+  int n, ref;
 
   if(((uint64)pa % PGSIZE) != 0 || (char*)pa < end || (uint64)pa >= PHYSTOP)
     panic("kfree");
 
+  ref = __sync_sub_and_fetch(&kmem.ref[PA2REF(pa)], 1);
+  if(ref < 0)
+    panic("kfree: ref");
+  if(ref > 0)
+    return;
+
+#ifdef KJUNK
   // Fill with junk to catch dangling refs.
   memset(pa, 1, PGSIZE);
+#endif
 
   r = (struct run*)pa;
 
-  acquire(&kmem.lock);
-  r->next = kmem.freelist;
-  kmem.freelist = r;
-  release(&kmem.lock);
+  push_off();
+  l = &kmem.cpu[cpuid()];
+  acquire(&l->lock);
+  r->next = l->freelist;
+  l->freelist = r;
+  l->nfree++;
+  n = KBATCH;
+  if(l->nfree > KCPUPAGES)
+    chain = ktake(l, &n);
+  release(&l->lock);
+  pop_off();
+
+  if(chain)
+    kgiveback(chain);
+}
+
+// Take back pages from the file page cache and the
+// buffer cache. Returns the number of pages freed.
+// The buffer cache may be calling kalloc itself: bshrink
+// gives nothing back while this CPU holds a bio lock.
+static int
+kreclaim(void)
+{
+  return pcreclaim() + bshrink();
+}
+
+// Give the pages cached by every CPU, and the zeroed ones,
+// back to the buddy allocator, so they can merge into bigger
+// blocks.
+static void
+kdrainlist(struct kfreelist *l)
+{
+  struct run *chain;
+  int n;
+
+  acquire(&l->lock);
+  n = l->nfree;
+  chain = ktake(l, &n);
+  release(&l->lock);
+  kgiveback(chain);
+}
+
+static void
+kdrain(void)
+{
+  int i;
+
+  for(i = 0; i < NCPU; i++)
+    kdrainlist(&kmem.cpu[i]);
+  kdrainlist(&kmem.zeroed);
+}
+
+// Allocate 2^order physically contiguous pages, aligned to
+// their size. Each page has one reference and can be freed on
+// its own with kfree, or all together with kfree_pages.
+// Returns 0 if the memory cannot be allocated.
+void *
+kalloc_pages(int order)
+{
+  uint64 pa, i;
+  int tries;
+
+  if(order < 0 || order > MAXORDER)
+    panic("kalloc_pages");
+
+  // if memory is fragmented, first gather the pages cached
+  // by the CPUs, then those of the page and buffer caches.
+  for(tries = 0; tries < 3; tries++){
+    acquire(&buddy.lock);
+    pa = buddy_alloc(order);
+    release(&buddy.lock);
+    if(pa)
+      break;
+    if(tries == 0)
+      kdrain();
+    else if(tries == 1 && kreclaim() > 0)
+      kdrain();
+  }
+  if(pa == 0)
+    return 0;
+
+  for(i = 0; i < (1L << order); i++)
+    kmem.ref[PA2REF(pa) + i] = 1;
+#ifdef KJUNK
+  memset((char*)pa, 5, (uint64)PGSIZE << order); // fill with junk
+#endif
+  return (void*)pa;
+}
+
+// Drop a reference to each page of a block from kalloc_pages.
+// If that frees them all, the block goes back whole.
+void
+kfree_pages(void *pa, int order)
+{
+  uint64 i, n = 1L << order;
+  int nfreed = 0, ref;
+
+  if(((uint64)pa % ((uint64)PGSIZE << order)) != 0 || (char*)pa < end || (uint64)pa >= PHYSTOP)
+    panic("kfree_pages");
+
+  for(i = 0; i < n; i++){
+    ref = __sync_sub_and_fetch(&kmem.ref[PA2REF(pa) + i], 1);
+    if(ref < 0)
+      panic("kfree_pages: ref");
+    if(ref == 0)
+      nfreed++;
+  }
+  if(nfreed == 0)
+    return;
+
+  acquire(&buddy.lock);
+  if(nfreed == n){
+#ifdef KJUNK
+    memset(pa, 1, (uint64)PGSIZE << order);
+#endif
+    buddy_free((uint64)pa, order);
+  } else {
+    for(i = 0; i < n; i++){
+      char *p = (char*)pa + i*PGSIZE;
+      if(kmem.ref[PA2REF(p)] == 0){
+#ifdef KJUNK
+        memset(p, 1, PGSIZE);
+#endif
+        buddy_free((uint64)p, 0);
+      }
+    }
+  }
+  release(&buddy.lock);
+}
+
+// Take a free page from this CPU's list, refilling it
+// if it is empty. Returns 0 if there are none.
+static struct run*
+kget(void)
+{
+  struct run *r;
+  struct kfreelist *l;
+  int id;
+
+  push_off();
+  id = cpuid();
+  l = &kmem.cpu[id];
+  acquire(&l->lock);
+  r = l->freelist;
+  if(r){
+    l->freelist = r->next;
+    l->nfree--;
+  }
+  release(&l->lock);
+  if(r == 0)
+    r = krefill(id);
+  pop_off();
+  return r;
+}
+
+// Take a page from the pool of zeroed pages, or return 0.
+static struct run*
+kgetzeroed(void)
+{
+  struct run *r;
+
+  acquire(&kmem.zeroed.lock);
+  r = kmem.zeroed.freelist;
+  if(r){
+    kmem.zeroed.freelist = r->next;
+    kmem.zeroed.nfree--;
+  }
+  release(&kmem.zeroed.lock);
+  return r;
 }
 
 // Allocate one 4096-byte page of physical memory.
@@ -69,14 +475,93 @@ void *
 kalloc(void)
 {
   struct run *r;
+  int reclaimed = 0;
 
-  acquire(&kmem.lock);
-  r = kmem.freelist;
-  if(r)
-    kmem.freelist = r->next;
-  release(&kmem.lock);
+  for(;;){
+    if((r = kget()) == 0)
+      r = kgetzeroed();
+    // out of memory: take back the pages the caches keep
+    // only in case they are used again.
+    if(r || reclaimed || kreclaim() == 0)
+      break;
+    reclaimed = 1;
+  }
 
-  if(r)
+  if(r){
+    kmem.ref[PA2REF(r)] = 1;
+#ifdef KJUNK
     memset((char*)r, 5, PGSIZE); // fill with junk
+#endif
+  }
   return (void*)r;
 }
+
+// Allocate one page filled with zeros, preferably one
+// zeroed ahead of time by an idle CPU.
+// Returns 0 if the memory cannot be allocated.
+void *
+kalloc_zeroed(void)
+{
+  struct run *r;
+
+  if((r = kgetzeroed()) == 0){
+    if((r = kalloc()) != 0)
+      memset(r, 0, PGSIZE);
+    return (void*)r;
+  }
+  r->next = 0;  // the only word the pool wrote
+  kmem.ref[PA2REF(r)] = 1;
+  return (void*)r;
+}
+
+// Zero one free page for kalloc_zeroed, if the pool of
+// zeroed pages is not full. Called by idle CPUs.
+// Returns 1 if it zeroed a page, 0 if there was nothing to do.
+int
+kzerofill(void)
+{
+  struct run *r;
+
+  if(kmem.zeroed.nfree >= KZEROPAGES)
+    return 0;
+  if((r = kget()) == 0)
+    return 0;
+  memset(r, 0, PGSIZE);
+  acquire(&kmem.zeroed.lock);
+  r->next = kmem.zeroed.freelist;
+  kmem.zeroed.freelist = r;
+  kmem.zeroed.nfree++;
+  release(&kmem.zeroed.lock);
+  return 1;
+}
+
+// The number of free pages, without locking, so only
+// roughly right.
+int
+knfree(void)
+{
+  int i, n;
+
+  n = buddy.nfree + kmem.zeroed.nfree;
+  for(i = 0; i < NCPU; i++)
+    n += kmem.cpu[i].nfree;
+  return n;
+}
+
+// Add a reference to the allocated page pa.
+void
+kdup(void *pa)
+{
+  if(((uint64)pa % PGSIZE) != 0 || (char*)pa < end || (uint64)pa >= PHYSTOP)
+    panic("kdup");
+
+  if(__sync_fetch_and_add(&kmem.ref[PA2REF(pa)], 1) < 1)
+    panic("kdup: free page");
+}
+
+// Number of references to the allocated page pa.
+int
+krefs(void *pa)
+{
+  return __atomic_load_n(&kmem.ref[PA2REF(pa)], __ATOMIC_SEQ_CST);
+}
@@ -64,21 +64,30 @@ initlog(int dev, struct superblock *sb)
   recover_from_log();
 }
 
-// Copy committed blocks from log to their home location
+// Copy committed blocks from log to their home location,
+// LOGBATCH blocks at a time, adjacent ones in one request.
 static void
 install_trans(int recovering)
 {
-  int tail;
+  struct buf *dbufs[LOGBATCH];
+  int tail, i, n = 0;
 
   for (tail = 0; tail < log.lh.n; tail++) {
     struct buf *lbuf = bread(log.dev, log.start+tail+1); // read log block
     struct buf *dbuf = bread(log.dev, log.lh.block[tail]); // read dst
     memmove(dbuf->data, lbuf->data, BSIZE);  // copy block to dst
-    bwrite(dbuf);  // write dst to disk
-    if(recovering == 0)
-      bunpin(dbuf);
     brelse(lbuf);
-    brelse(dbuf);
+    dbufs[n++] = dbuf;
+    if(n == LOGBATCH || tail == log.lh.n - 1){
+      bstart(dbufs, n, 1);  // write dst to disk
+      for(i = 0; i < n; i++){
+        bwait(dbufs[i]);
+        if(recovering == 0)
+          bunpin(dbufs[i]);
+        brelse(dbufs[i]);
+      }
+      n = 0;
+    }
   }
 }
 
@@ -174,19 +183,28 @@ end_op(void)
   }
 }
 
-// Copy modified blocks from cache to log.
+// Copy modified blocks from cache to log,
+// LOGBATCH blocks at a time, each batch in one request.
 static void
 write_log(void)
 {
-  int tail;
+  struct buf *tos[LOGBATCH];
+  int tail, i, n = 0;
 
   for (tail = 0; tail < log.lh.n; tail++) {
     struct buf *to = bread(log.dev, log.start+tail+1); // log block
     struct buf *from = bread(log.dev, log.lh.block[tail]); // cache block
     memmove(to->data, from->data, BSIZE);
-    bwrite(to);  // write the log
     brelse(from);
-    brelse(to);
+    tos[n++] = to;
+    if(n == LOGBATCH || tail == log.lh.n - 1){
+      bstart(tos, n, 1);  // write the log, in one request
+      for(i = 0; i < n; i++){
+        bwait(tos[i]);
+        brelse(tos[i]);
+      }
+      n = 0;
+    }
   }
 }
 
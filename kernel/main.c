@@ -19,12 +19,14 @@ main()
     kinit();         // physical page allocator
     kvminit();       // create kernel page table
     kvminithart();   // turn on paging
+    vmainit();       // vm area allocator
     procinit();      // process table
     trapinit();      // trap vectors
     trapinithart();  // install kernel trap vector
     plicinit();      // set up interrupt controller
     plicinithart();  // ask PLIC for device interrupts
     binit();         // buffer cache
+    pcinit();        // page cache for shared mappings
     iinit();         // inode table
     fileinit();      // file table
     virtio_disk_init(); // emulated hard disk
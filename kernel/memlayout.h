@@ -57,3 +57,7 @@
 //   TRAPFRAME (p->trapframe, used by the trampoline)
 //   TRAMPOLINE (the same page as in the kernel)
 #define TRAPFRAME (TRAMPOLINE - PGSIZE)
+
+// mmap() places mappings top-down below MMAPTOP, far from the
+// heap that grows up from p->sz.
+#define MMAPTOP TRAPFRAME
@@ -0,0 +1,457 @@
+// Page cache of file pages mapped into user memory.
+//
+// Every process that maps the same page of the same file with
+// MAP_SHARED maps the same physical page from this cache, so
+// stores by one process are seen by the others without a trip
+// through the disk. Read-only private mappings, such as the
+// text of a program, map the cached page too, so processes
+// running the same binary share one copy of it.
+//
+// Entries are keyed by (dev, inum, page offset) and counted by
+// the number of shared mappings that refer to them; dirty data
+// must be written back by the caller before the last one is
+// removed (see write_back()). A read-only private mapping holds
+// a kalloc() reference to the page instead (see kdup), so the
+// entry can be reused while the page stays mapped.
+//
+// Entries no one refers to stay cached, so mapping the same
+// pages again (running the same program again) reads nothing
+// from the disk. Once there are NPCPAGE entries they are reused
+// in clock order, and the cache grows only when all are
+// referenced. Their pages are given back when kalloc() runs out
+// of memory. Entries live in groups, one kalloc() page per
+// group; a group is never freed.
+//
+// A page can also be marked dirty in the cache (msync(MS_ASYNC)),
+// which queues it to be written in the background: pcflush, called
+// on the way back to user space, writes the queued pages every
+// PCFLUSHTICKS ticks. The next msync(MS_SYNC) or munmap of any
+// process mapping the page writes it too, if that comes first.
+//
+// Interface:
+// * To get the page for a file offset, call pcget with the
+//     inode locked; the page is read from the file on a miss.
+// * When a mapping of the page is removed, call pcput.
+// * pcsetdirty queues a write, pcclrdirty claims it, pcflush
+//     does the queued writes.
+// * writei calls pcwrite and itrunc calls pctrunc to keep the
+//     cache in step with the file.
+
+#include "types.h"
+#include "param.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "riscv.h"
+#include "defs.h"
+#include "fs.h"
+#include "file.h"
+
+struct pcpage {
+  uint dev;
+  uint inum;
+  uint off;              // page-aligned offset in the file
+  int ref;               // number of shared mappings
+  int dirty;             // queued to be written to the file
+  int used;              // referenced since the clock hand passed
+  char *pa;              // the cached page; 0 means free
+  struct pcpage *next;   // hash chain or free list
+  struct pcpage *inext;  // chain of the inode's bucket
+};
+
+#define PCPERGROUP ((PGSIZE - sizeof(void*)) / sizeof(struct pcpage))
+
+struct pcgroup {
+  struct pcgroup *next;
+  struct pcpage page[PCPERGROUP];
+};
+
+struct {
+  struct spinlock lock;
+  struct pcgroup *groups;
+  int n;                 // entries in all groups
+  struct pcpage *bucket[NPCBUCKET];   // by (dev, inum, off)
+  struct pcpage *ibucket[NPCBUCKET];  // by (dev, inum)
+  struct pcpage *freelist;
+  struct pcgroup *handg; // clock hand for reuse: entry hand of group handg
+  int hand;
+  int ndirty;            // entries with dirty set
+  uint lastflush;        // ticks at the last pcflush
+} pcache;
+
+static uint
+pchash(uint dev, uint inum, uint off)
+{
+  return (dev * 31 + inum * 17 + off / PGSIZE) % NPCBUCKET;
+}
+
+static uint
+pcihash(uint dev, uint inum)
+{
+  return (dev * 31 + inum * 17) % NPCBUCKET;
+}
+
+void
+pcinit(void)
+{
+  initlock(&pcache.lock, "pcache");
+}
+
+// Add a group of free entries to the cache.
+// Returns -1 if out of memory.
+static int
+pcgrow(void)
+{
+  struct pcgroup *g;
+  struct pcpage *e;
+
+  if((g = (struct pcgroup*)kalloc()) == 0)
+    return -1;
+  memset(g, 0, PGSIZE);
+
+  acquire(&pcache.lock);
+  for(e = g->page; e < g->page + PCPERGROUP; e++){
+    e->next = pcache.freelist;
+    pcache.freelist = e;
+  }
+  g->next = pcache.groups;
+  pcache.groups = g;
+  pcache.n += PCPERGROUP;
+  release(&pcache.lock);
+  return 0;
+}
+
+// Look up the entry for (dev, inum, off).
+// Caller must hold pcache.lock.
+static struct pcpage*
+pclookup(uint dev, uint inum, uint off)
+{
+  struct pcpage *e;
+
+  for(e = pcache.bucket[pchash(dev, inum, off)]; e; e = e->next){
+    if(e->dev == dev && e->inum == inum && e->off == off)
+      return e;
+  }
+  return 0;
+}
+
+// Remove an unreferenced entry from its hash chain and put it
+// on the free list. Returns its page, for the caller to kfree
+// after releasing pcache.lock.
+static char*
+pcevict(struct pcpage *e)
+{
+  struct pcpage **pp;
+  char *pa;
+
+  if(e->ref != 0 || e->pa == 0)
+    panic("pcevict");
+  pp = &pcache.bucket[pchash(e->dev, e->inum, e->off)];
+  while(*pp != e)
+    pp = &(*pp)->next;
+  *pp = e->next;
+  pp = &pcache.ibucket[pcihash(e->dev, e->inum)];
+  while(*pp != e)
+    pp = &(*pp)->inext;
+  *pp = e->inext;
+  pa = e->pa;
+  e->pa = 0;
+  e->next = pcache.freelist;
+  pcache.freelist = e;
+  return pa;
+}
+
+// Return the cached page holding the file data at offset off,
+// reading it from the file if it is not cached, and take a
+// reference to it for the caller's mapping.
+// Caller must hold ip->lock, which also serializes the
+// filling of ip's pages.
+// Returns 0 if out of memory.
+char*
+pcget(struct inode *ip, uint off)
+{
+  struct pcpage *e;
+  char *pa, *old = 0;
+  int i, n;
+
+  if(off % PGSIZE != 0)
+    panic("pcget: offset not aligned");
+  if(!holdingsleep(&ip->lock))
+    panic("pcget: inode not locked");
+
+  acquire(&pcache.lock);
+  if((e = pclookup(ip->dev, ip->inum, off)) != 0){
+    e->ref++;
+    e->used = 1;
+    release(&pcache.lock);
+    return e->pa;
+  }
+  release(&pcache.lock);
+
+  // Not cached; read the page outside the spinlock.
+  if((pa = kalloc()) == 0)
+    return 0;
+  n = 0;
+  if(off < ip->size && (n = readi(ip, 0, (uint64)pa, off, PGSIZE)) <= 0){
+    kfree(pa);
+    return 0;
+  }
+  memset(pa + n, 0, PGSIZE - n);  // past the end of the file
+
+  acquire(&pcache.lock);
+  if(pcache.freelist == 0 && pcache.n >= NPCPAGE){
+    // reuse an unreferenced entry, giving recently used ones
+    // a second chance
+    for(i = 0; i < 2*pcache.n; i++){
+      if(pcache.handg == 0){
+        pcache.handg = pcache.groups;
+        pcache.hand = 0;
+      }
+      e = &pcache.handg->page[pcache.hand];
+      if(++pcache.hand == PCPERGROUP){
+        pcache.handg = pcache.handg->next;
+        pcache.hand = 0;
+      }
+      if(e->pa == 0 || e->ref > 0)
+        continue;
+      if(e->used){
+        e->used = 0;
+        continue;
+      }
+      old = pcevict(e);
+      break;
+    }
+  }
+  while((e = pcache.freelist) == 0){
+    release(&pcache.lock);
+    if(pcgrow() < 0){
+      kfree(pa);
+      return 0;
+    }
+    acquire(&pcache.lock);
+  }
+  pcache.freelist = e->next;
+  e->dev = ip->dev;
+  e->inum = ip->inum;
+  e->off = off;
+  e->ref = 1;
+  e->dirty = 0;
+  e->used = 1;
+  e->pa = pa;
+  e->next = pcache.bucket[pchash(e->dev, e->inum, off)];
+  pcache.bucket[pchash(e->dev, e->inum, off)] = e;
+  e->inext = pcache.ibucket[pcihash(e->dev, e->inum)];
+  pcache.ibucket[pcihash(e->dev, e->inum)] = e;
+  release(&pcache.lock);
+
+  if(old)
+    kfree(old);
+  return pa;
+}
+
+// Drop a mapping's reference to the page at offset off of ip.
+// The page stays cached.
+void
+pcput(struct inode *ip, uint off)
+{
+  struct pcpage *e;
+
+  acquire(&pcache.lock);
+  if((e = pclookup(ip->dev, ip->inum, off)) == 0 || e->ref < 1)
+    panic("pcput");
+  e->ref--;
+  release(&pcache.lock);
+}
+
+// Give the pages of all unreferenced entries back to kalloc.
+// Returns the number of entries dropped.
+int
+pcreclaim(void)
+{
+  struct pcgroup *g;
+  struct pcpage *e;
+  char *pa;
+  int n = 0;
+
+  acquire(&pcache.lock);
+  g = pcache.groups;
+  release(&pcache.lock);
+  // groups are never freed
+  for(; g; g = g->next){
+    for(e = g->page; e < g->page + PCPERGROUP; e++){
+      pa = 0;
+      acquire(&pcache.lock);
+      if(e->pa != 0 && e->ref == 0)
+        pa = pcevict(e);
+      release(&pcache.lock);
+      if(pa){
+        kfree(pa);
+        n++;
+      }
+    }
+  }
+  return n;
+}
+
+// The n bytes of ip at off, inside one page, have been written
+// from data. Copy them into the cached page, so mapped pages of
+// the file never serve stale data, unless src, the kernel
+// address they were written from, lies in that page: then the
+// page has them already, and a store since then must not be
+// undone.
+// Caller must hold ip->lock.
+void
+pcwrite(struct inode *ip, uint off, char *data, uint n, char *src)
+{
+  struct pcpage *e;
+  char *pa;
+  uint pg = PGROUNDDOWN(off);
+
+  acquire(&pcache.lock);
+  e = pclookup(ip->dev, ip->inum, pg);
+  if(e == 0 || (src >= e->pa && src < e->pa + PGSIZE)){
+    release(&pcache.lock);
+    return;
+  }
+  if(e->ref == 0){
+    // no one maps it, reading it again is cheaper
+    pa = pcevict(e);
+    release(&pcache.lock);
+    kfree(pa);
+    return;
+  }
+  memmove(e->pa + (off - pg), data, n);
+  release(&pcache.lock);
+}
+
+// ip has been truncated to size 0. Drop the cached pages of ip
+// that no one maps. Mapped ones are left as they are, zeroing
+// them under the mappings would lose stores; nothing past the
+// end of the file is ever written back (see write_page()).
+// Caller must hold ip->lock.
+void
+pctrunc(struct inode *ip)
+{
+  struct pcpage *e;
+  char *pa;
+
+  for(;;){
+    pa = 0;
+    acquire(&pcache.lock);
+    for(e = pcache.ibucket[pcihash(ip->dev, ip->inum)]; e; e = e->inext){
+      if(e->dev == ip->dev && e->inum == ip->inum && e->ref == 0){
+        pa = pcevict(e);
+        break;
+      }
+    }
+    release(&pcache.lock);
+    if(pa == 0)
+      break;
+    kfree(pa);
+  }
+}
+
+// Queue the cached page at offset off of ip to be written back.
+void
+pcsetdirty(struct inode *ip, uint off)
+{
+  struct pcpage *e;
+
+  acquire(&pcache.lock);
+  if((e = pclookup(ip->dev, ip->inum, off)) == 0)
+    panic("pcsetdirty");
+  if(!e->dirty)
+    pcache.ndirty++;
+  e->dirty = 1;
+  release(&pcache.lock);
+}
+
+// Is a write of the page at offset off of ip queued?
+int
+pcisdirty(struct inode *ip, uint off)
+{
+  struct pcpage *e;
+  int dirty;
+
+  acquire(&pcache.lock);
+  if((e = pclookup(ip->dev, ip->inum, off)) == 0)
+    panic("pcisdirty");
+  dirty = e->dirty;
+  release(&pcache.lock);
+  return dirty;
+}
+
+// Clear the queued write of the page at offset off of ip.
+// Returns 1 if it was queued, in which case the caller must
+// write the page.
+int
+pcclrdirty(struct inode *ip, uint off)
+{
+  struct pcpage *e;
+  int dirty;
+
+  acquire(&pcache.lock);
+  if((e = pclookup(ip->dev, ip->inum, off)) == 0)
+    panic("pcclrdirty");
+  dirty = e->dirty;
+  if(dirty)
+    pcache.ndirty--;
+  e->dirty = 0;
+  release(&pcache.lock);
+  return dirty;
+}
+
+// Write the pages queued by pcsetdirty to their files, if
+// PCFLUSHTICKS have passed since the last time. The pages stay
+// cached and mapped.
+// Called by usertrap, holding no locks.
+void
+pcflush(void)
+{
+  struct pcgroup *g;
+  struct pcpage *e;
+  struct inode *ip;
+  uint dev, inum, off, n;
+
+  // a stale count only delays the flush to the next trap
+  if(pcache.ndirty == 0)
+    return;
+  acquire(&pcache.lock);
+  if(pcache.ndirty == 0 || ticks - pcache.lastflush < PCFLUSHTICKS){
+    release(&pcache.lock);
+    return;
+  }
+  pcache.lastflush = ticks;
+  g = pcache.groups;
+  release(&pcache.lock);
+
+  // groups are never freed; pages queued in ones added since
+  // wait for the next flush
+  for(; g; g = g->next){
+    for(e = g->page; e < g->page + PCPERGROUP; e++){
+      acquire(&pcache.lock);
+      if(e->pa == 0 || !e->dirty){
+        release(&pcache.lock);
+        continue;
+      }
+      // a queued page is mapped, so its inode is in use
+      e->dirty = 0;
+      pcache.ndirty--;
+      e->ref++;  // keep it while writing without the lock
+      dev = e->dev;
+      inum = e->inum;
+      off = e->off;
+      release(&pcache.lock);
+
+      begin_op();
+      ip = iget(dev, inum);
+      ilock(ip);
+      if(off < ip->size){
+        n = ip->size - off < PGSIZE ? ip->size - off : PGSIZE;
+        writei(ip, 0, (uint64)e->pa, off, n);
+      }
+      pcput(ip, off);
+      iunlockput(ip);
+      end_op();
+    }
+  }
+}
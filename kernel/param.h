@@ -1,16 +1,36 @@
 #define NPROC        64  // maximum number of processes
 #define NCPU          8  // maximum number of CPUs
+#define KBATCH       32  // pages moved at once between CPU free lists and the pool
+#define KCPUPAGES   128  // free pages a CPU keeps before giving a batch back
+#define KZEROPAGES   64  // pages idle CPUs keep zeroed for kalloc_zeroed()
+#define MAXORDER     10  // largest kalloc_pages() block is 2^MAXORDER pages
+#define SUPERPGFREE  32  // free superpages needed to back user memory with one
 #define NOFILE       16  // open files per process
 #define NFILE       100  // open files per system
 #define NINODE       50  // maximum number of active i-nodes
 #define NDEV         10  // maximum major device number
 #define ROOTDEV       1  // device number of file system root disk
 #define MAXARG       32  // max exec arguments
+#define MAXSPAWNACT  16  // max file actions of a spawn
+#define MAXSEG        4  // max demand-paged segments of a program
 #define MAXOPBLOCKS  10  // max # of blocks any FS op writes
 #define LOGSIZE      (MAXOPBLOCKS*3)  // max data blocks in on-disk log
-#define NBUF         (MAXOPBLOCKS*3)  // size of disk block cache
+#define LOGBATCH     8     // log block writes in flight at once
+#define MAXRUN       16    // most blocks in one disk request
+#define RAMIN        4     // first readahead window, in blocks
+#define RAMAX        64    // largest readahead window, in blocks
+#define NBUF         (LOGSIZE+LOGBATCH)  // least size of disk block cache: a commit pins LOGSIZE, writes LOGBATCH
+#define NBUFMAX      4096  // most buffers the disk block cache grows to
+#define NBUFFREE     1024  // free pages needed for the block cache to grow
+#define NBUFBUCKET   251   // hash buckets of the disk block cache
 #define FSSIZE       2000  // size of file system in blocks
 #define MAXPATH      128   // maximum file path name
 #define USERSTACK    1     // user stack pages
-#define NVMA         16    // slots of vm areas
+#define NVMA         512   // max vm areas per process (one page of pointers)
+#define FAULTAROUND  16    // pages populated around an mmap fault
+#define MAXFAULTAROUND 256 // largest window for sequential mmap faults
+#define NPCPAGE      2048  // page cache entries kept before reusing unreferenced ones
+#define NPCBUCKET    251   // hash buckets of the page cache
+#define PCFLUSHTICKS 10    // ticks between writes of msync(MS_ASYNC) pages
+#define PIPESIZE     512   // bytes buffered by a pipe
 
@@ -8,8 +8,6 @@
 #include "sleeplock.h"
 #include "file.h"
 
-#define PIPESIZE 512
-
 struct pipe {
   struct spinlock lock;
   char data[PIPESIZE];
@@ -90,7 +88,7 @@ pipewrite(struct pipe *pi, uint64 addr, int n)
       sleep(&pi->nwrite, &pi->lock);
     } else {
       char ch;
-      if(copyin(pr->pagetable, &ch, addr + i, 1) == -1)
+      if(copyin(pr->pagetable, &ch, addr + i, 1, 0) == -1)
         break;
       pi->data[pi->nwrite++ % PIPESIZE] = ch;
       i++;
@@ -121,7 +119,7 @@ piperead(struct pipe *pi, uint64 addr, int n)
     if(pi->nread == pi->nwrite)
       break;
     ch = pi->data[pi->nread++ % PIPESIZE];
-    if(copyout(pr->pagetable, addr + i, &ch, 1) == -1)
+    if(copyout(pr->pagetable, addr + i, &ch, 1, 0) == -1)
       break;
   }
   wakeup(&pi->nwrite);  //DOC: piperead-wakeup
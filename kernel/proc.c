@@ -5,6 +5,8 @@
 #include "spinlock.h"
 #include "proc.h"
 #include "defs.h"
+#include "fcntl.h"
+#include "spawn.h"
 
 struct cpu cpus[NCPU];
 
@@ -141,12 +143,9 @@ found:
   }
 
   // check if the vmas deleted
-  for (int i=0; i < NVMA; ++i) {
-    if (proc->vm_areas[i].length != 0) {
-      panic("allocproc: vma contains data");
-    }
+  if (p->nvma != 0 || p->vmas != 0) {
+    panic("allocproc: vma contains data");
   }
-  proc->next_start = 0;
 
   // Set up new context to start executing at forkret,
   // which returns to user space.
@@ -167,11 +166,14 @@ freeproc(struct proc *p)
     kfree((void*)p->trapframe);
   p->trapframe = 0;
   if(p->pagetable) {
-    proc_free_vmareas(p->pagetable, p->vm_areas);
-    proc_freepagetable(p->pagetable, p->sz);
+    proc_free_vmareas(p, p->pagetable);
+    proc_freepagetable(p->pagetable, p->stack, p->heap, p->sz);
   }
+  vma_freeindex(p);
   p->pagetable = 0;
   p->sz = 0;
+  p->stack = 0;
+  p->heap = 0;
   p->pid = 0;
   p->parent = 0;
   p->name[0] = 0;
@@ -180,12 +182,9 @@ freeproc(struct proc *p)
   p->xstate = 0;
   p->state = UNUSED;
 
-  // check if the vmas deleted
-  for (int i=0; i < NVMA; ++i) {
-    if (proc->vm_areas[i].length != 0) {
-      memset(&proc->vm_areas[i], 0, sizeof(struct vm_area));
-      printf("freeproc: vma not released when exit\n");
-    }
+  // the vmas are released with the page table above
+  if (p->nvma != 0 || p->vmas != 0) {
+    panic("freeproc: vma not released");
   }
 }
 
@@ -207,7 +206,7 @@ proc_pagetable(struct proc *p)
   // to/from user space, so not PTE_U.
   if(mappages(pagetable, TRAMPOLINE, PGSIZE,
               (uint64)trampoline, PTE_R | PTE_X) < 0){
-    uvmfree(pagetable, 0);
+    uvmfree(pagetable, 0, 0, 0);
     return 0;
   }
 
@@ -216,7 +215,7 @@ proc_pagetable(struct proc *p)
   if(mappages(pagetable, TRAPFRAME, PGSIZE,
               (uint64)(p->trapframe), PTE_R | PTE_W) < 0){
     uvmunmap(pagetable, TRAMPOLINE, 1, 0);
-    uvmfree(pagetable, 0);
+    uvmfree(pagetable, 0, 0, 0);
     return 0;
   }
 
@@ -224,22 +223,23 @@ proc_pagetable(struct proc *p)
 }
 
 // Free a process's page table, and free the
-// physical memory it refers to.
+// physical memory it refers to. The process's
+// stack is [stack, heap), see uvmfree.
 void
-proc_freepagetable(pagetable_t pagetable, uint64 sz)
+proc_freepagetable(pagetable_t pagetable, uint64 stack, uint64 heap, uint64 sz)
 {
   uvmunmap(pagetable, TRAMPOLINE, 1, 0);
   uvmunmap(pagetable, TRAPFRAME, 1, 0);
-  uvmfree(pagetable, sz);
+  uvmfree(pagetable, stack, heap, sz);
 }
 
-// free vma
+// free vma, unmapping their pages from pagetable
 void
-proc_free_vmareas(pagetable_t pagetable, struct vm_area * areas) {
-  for (int i=0; i < NVMA; ++i) {
-    if (areas[i].length > 0) {
-      clear_vm_area(&(areas[i]), pagetable);
-    }
+proc_free_vmareas(struct proc *p, pagetable_t pagetable) {
+  while (p->nvma > 0) {
+    struct vm_area *area = p->vmas[p->nvma - 1];
+    clear_vm_area(area, pagetable);
+    vma_remove(p, area);
   }
 }
 
@@ -292,11 +292,34 @@ growproc(int n)
 
   sz = p->sz;
   if(n > 0){
-    if((sz = uvmalloc(p->pagetable, sz, sz + n, PTE_W)) == 0) {
+    // the heap must not grow into a mapping
+    struct vm_area *area = vma_next(p, PGROUNDUP(sz));
+    if(sz + n > MMAPTOP || (area && area->start_addr < sz + n))
       return -1;
+    // pages are allocated as they are touched, see uvmlazy()
+    sz += n;
+  } else if(n < 0 && sz + n < sz){
+    // a heap superpage the new end cuts through is split first
+    if(uvmsplit(p->pagetable, PGROUNDUP(sz + n)) != 0)
+      return -1;
+    uvmunmapproc(p->pagetable, PGROUNDUP(sz + n), PGROUNDUP(sz), p->stack, p->heap);
+    sz += n;
+    // shrunk into the stack: only the pages below the new end
+    // are left of it, and growing again makes heap
+    if(p->heap > PGROUNDUP(sz))
+      p->heap = PGROUNDUP(sz);
+    if(p->stack > p->heap)
+      p->stack = p->heap;
+    // the exec image segments shrink with it
+    struct vm_area *area;
+    while((area = vma_next(p, PGROUNDUP(sz))) != 0 && area->image){
+      if(area->start_addr < PGROUNDUP(sz)){
+        area->length = PGROUNDUP(sz) - area->start_addr;
+      } else {
+        fileclose(area->fptr);
+        vma_remove(p, area);
+      }
     }
-  } else if(n < 0){
-    sz = uvmdealloc(p->pagetable, sz, sz + n);
   }
   p->sz = sz;
   return 0;
@@ -317,21 +340,46 @@ fork(void)
   }
 
   // Copy user memory from parent to child.
-  if(uvmcopy(p->pagetable, np->pagetable, p->sz) < 0){
+  if(uvmcopy(p->pagetable, np->pagetable, p->stack, p->heap, p->sz) < 0){
     freeproc(np);
     release(&np->lock);
     return -1;
   }
   np->sz = p->sz;
+  np->stack = p->stack;
+  np->heap = p->heap;
 
   // copy vma
-  for (i=0; i < NVMA; ++i) {
-    memmove(&(np->vm_areas[i]), &(p->vm_areas[i]), sizeof(struct vm_area));
-    if (np->vm_areas[i].length > 0) {
-      filedup(np->vm_areas[i].fptr);
+  for (i=0; i < p->nvma; ++i) {
+    struct vm_area *area = vma_alloc();
+    if (area == 0) {
+      freeproc(np);
+      release(&np->lock);
+      return -1;
+    }
+    memmove(area, p->vmas[i], sizeof(struct vm_area));
+    if (area->fptr != NULL) {
+      filedup(area->fptr);
+    }
+    if (vma_insert(np, area) < 0) {
+      if (area->fptr != NULL) {
+        fileclose(area->fptr);
+      }
+      vma_free(area);
+      freeproc(np);
+      release(&np->lock);
+      return -1;
+    }
+    // private pages hold data the file (if any) does not have,
+    // so the child shares those already touched, copy-on-write
+    if ((area->flags & MAP_PRIVATE) && !area->image &&
+        uvmcopyrange(p->pagetable, np->pagetable, area->start_addr,
+                     area->start_addr + area->length) < 0) {
+      freeproc(np);
+      release(&np->lock);
+      return -1;
     }
   }
-  np->next_start = p->next_start;
 
   // copy saved user registers.
   *(np->trapframe) = *(p->trapframe);
@@ -362,6 +410,81 @@ fork(void)
   return pid;
 }
 
+// Create a new process running the program path, built
+// directly from the ELF file rather than by copying the
+// caller's memory only for exec to throw it away.
+// The child gets the caller's open files, edited by the
+// nact actions in act, and its current directory.
+// Returns the child's pid, or -1.
+int
+spawn(char *path, char **argv, struct spawn_action *act, int nact)
+{
+  int i, fd, argc, pid;
+  struct proc *np;
+  struct proc *p = myproc();
+  struct file *ofile[NOFILE];
+
+  // Apply the actions to a copy of the caller's table,
+  // so there is nothing to undo if one of them fails.
+  memmove(ofile, p->ofile, sizeof(ofile));
+  for(i = 0; i < nact; i++){
+    fd = act[i].fd;
+    if(fd < 0 || fd >= NOFILE)
+      return -1;
+    switch(act[i].op){
+    case SPAWN_CLOSE:
+      ofile[fd] = 0;
+      break;
+    case SPAWN_DUP2:
+      if(act[i].newfd < 0 || act[i].newfd >= NOFILE || ofile[fd] == 0)
+        return -1;
+      ofile[act[i].newfd] = ofile[fd];
+      break;
+    default:
+      return -1;
+    }
+  }
+
+  // Allocate process.
+  if((np = allocproc()) == 0){
+    return -1;
+  }
+  memset(np->trapframe, 0, sizeof(*np->trapframe));
+  release(&np->lock);
+
+  // np is the caller's child from now on, like a forked one,
+  // so kill() and wait() see it while the program loads.
+  // It does not run until it is RUNNABLE.
+  acquire(&wait_lock);
+  np->parent = p;
+  release(&wait_lock);
+
+  if((argc = execproc(np, path, argv)) < 0){
+    // the caller is here, not in wait(), so np goes away
+    // unseen; wait_lock keeps reparent() off it meanwhile.
+    acquire(&wait_lock);
+    acquire(&np->lock);
+    freeproc(np);
+    release(&np->lock);
+    release(&wait_lock);
+    return -1;
+  }
+  np->trapframe->a0 = argc;
+
+  for(i = 0; i < NOFILE; i++)
+    if(ofile[i])
+      np->ofile[i] = filedup(ofile[i]);
+  np->cwd = idup(p->cwd);
+
+  pid = np->pid;
+
+  acquire(&np->lock);
+  np->state = RUNNABLE;
+  release(&np->lock);
+
+  return pid;
+}
+
 // Pass p's abandoned children to init.
 // Caller must hold wait_lock.
 void
@@ -389,11 +512,7 @@ exit(int status)
     panic("init exiting");
 
   // ummap all mappings
-  for (int i=0; i < NVMA; ++i) {
-    if (p->vm_areas[i].length > 0) {
-      clear_vm_area(p->vm_areas + i, p->pagetable);
-    }
-  }
+  proc_free_vmareas(p, p->pagetable);
 
   // Close all open files.
   for(int fd = 0; fd < NOFILE; fd++){
@@ -452,8 +571,9 @@ wait(uint64 addr)
         if(pp->state == ZOMBIE){
           // Found one.
           pid = pp->pid;
+          // holding locks: sys_wait faulted addr in
           if(addr != 0 && copyout(p->pagetable, addr, (char *)&pp->xstate,
-                                  sizeof(pp->xstate)) < 0) {
+                                  sizeof(pp->xstate), 0) < 0) {
             release(&pp->lock);
             release(&wait_lock);
             return -1;
@@ -516,8 +636,11 @@ scheduler(void)
       }
       release(&p->lock);
     }
-    if(found == 0) {
-      // nothing to run; stop running on this core until an interrupt.
+    if(found == 0 && kzerofill() == 0) {
+      // nothing to run, and no page to zero for kalloc_zeroed();
+      // stop running on this core until an interrupt. a page is
+      // zeroed per pass, so a process that becomes runnable waits
+      // for at most one.
       intr_on();
       asm volatile("wfi");
     }
@@ -686,7 +809,7 @@ either_copyout(int user_dst, uint64 dst, void *src, uint64 len)
 {
   struct proc *p = myproc();
   if(user_dst){
-    return copyout(p->pagetable, dst, src, len);
+    return copyout(p->pagetable, dst, src, len, 0);
   } else {
     memmove((char *)dst, src, len);
     return 0;
@@ -701,7 +824,7 @@ either_copyin(void *dst, int user_src, uint64 src, uint64 len)
 {
   struct proc *p = myproc();
   if(user_src){
-    return copyin(p->pagetable, dst, src, len);
+    return copyin(p->pagetable, dst, src, len, 0);
   } else {
     memmove(dst, (char*)src, len);
     return 0;
@@ -81,15 +81,19 @@ struct trapframe {
 
 enum procstate { UNUSED, USED, SLEEPING, RUNNABLE, RUNNING, ZOMBIE };
 
-// virtual memory area when length == 0 the area is not valid
+// virtual memory area, allocated by vma_alloc() in vma.c
 struct vm_area {
   uint64 start_addr; // start address
   uint64 length; // area: [start_addr, start_addr + length)
   int prot; // priority PROT_READ; PROT_WRITE
   int flags; // MAP_SHARED MAP_PRIVATE
   struct file * fptr; // pointer to file
-  uint64 valid_start;
-  uint64 valid_end;
+  uint64 offset; // file offset mapped at start_addr, page aligned
+  uint64 file_end; // file offset where the mapped data ends, zeros beyond
+  int image; // a segment of the exec image, inside [0, p->sz)
+  uint64 ra_next; // end of the last fault-around window
+  int ra_pages; // current fault-around window in pages, grows on sequential faults
+  int advice; // MADV_* access pattern given by madvise()
 };
 
 // Per-process state
@@ -109,9 +113,12 @@ struct proc {
   // these are private to the process, so p->lock need not be held.
   uint64 kstack;               // Virtual address of kernel stack
   uint64 sz;                   // Size of process memory (bytes)
+  uint64 stack;                // user stack [stack, heap), from exec
+  uint64 heap;                 // heap [heap, sz), allocated as touched
   pagetable_t pagetable;       // User page table
-  uint64 next_start;           // next start position of mmap
-  struct vm_area vm_areas[NVMA]; // virtual memory areas
+  struct vm_area **vmas;       // virtual memory areas, sorted by start_addr
+  int nvma;                    // number of areas in vmas
+  struct vm_area *vma_hit;     // area found by the last vma_find()
   struct trapframe *trapframe; // data page for trampoline.S
   struct context context;      // swtch() here to run process
   struct file *ofile[NOFILE];  // Open files
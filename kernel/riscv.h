@@ -357,12 +357,18 @@ typedef uint64 *pagetable_t; // 512 PTEs
 #define PGROUNDUP(sz)  (((sz)+PGSIZE-1) & ~(PGSIZE-1))
 #define PGROUNDDOWN(a) (((a)) & ~(PGSIZE-1))
 
+// a superpage (megapage) is mapped by one level-1 leaf PTE.
+#define SUPERPGORDER 9  // pages per superpage, as a power of 2
+#define SUPERPGSIZE (PGSIZE << SUPERPGORDER) // 2 MB
+#define SUPERPGROUNDDOWN(a) (((a)) & ~(SUPERPGSIZE-1))
+
 #define PTE_V (1L << 0) // valid
 #define PTE_R (1L << 1)
 #define PTE_W (1L << 2)
 #define PTE_X (1L << 3)
 #define PTE_U (1L << 4) // user can access
 #define PTE_D (1L << 7) // dirty
+#define PTE_COW (1L << 8) // copy-on-write, in a bit reserved for software
 
 // shift a physical address to the right place for a PTE.
 #define PA2PTE(pa) ((((uint64)pa) >> 12) << 10)
@@ -0,0 +1,10 @@
+#define SPAWN_CLOSE 1   // close fd in the child
+#define SPAWN_DUP2  2   // make newfd a copy of fd in the child
+
+// a file descriptor action for spawn(),
+// applied in order to the child's copy of the open files
+struct spawn_action {
+  int op;      // SPAWN_CLOSE or SPAWN_DUP2
+  int fd;
+  int newfd;   // SPAWN_DUP2 only
+};
@@ -1,13 +1,39 @@
 #include "types.h"
 
+// memset, memcmp and memmove work a 64-bit word at a time,
+// 8 words per loop iteration, once the pointers are aligned;
+// only the bytes before the first aligned word and after the
+// last one are done one at a time. Copies and compares whose
+// pointers cannot both be aligned go a byte at a time.
+
+#define WALIGNED(p) (((uint64)(p) & 7) == 0)
+
 void*
 memset(void *dst, int c, uint n)
 {
   char *cdst = (char *) dst;
-  int i;
-  for(i = 0; i < n; i++){
-    cdst[i] = c;
+  uint64 *wdst, w;
+
+  while(n > 0 && !WALIGNED(cdst)){
+    *cdst++ = c;
+    n--;
+  }
+  if(n >= 8){
+    w = (uchar)c;
+    w |= w << 8;
+    w |= w << 16;
+    w |= w << 32;
+    wdst = (uint64 *) cdst;
+    for(; n >= 64; n -= 64, wdst += 8){
+      wdst[0] = w; wdst[1] = w; wdst[2] = w; wdst[3] = w;
+      wdst[4] = w; wdst[5] = w; wdst[6] = w; wdst[7] = w;
+    }
+    for(; n >= 8; n -= 8)
+      *wdst++ = w;
+    cdst = (char *) wdst;
   }
+  while(n-- > 0)
+    *cdst++ = c;
   return dst;
 }
 
@@ -18,6 +44,16 @@ memcmp(const void *v1, const void *v2, uint n)
 
   s1 = v1;
   s2 = v2;
+  if(((uint64)s1 & 7) == ((uint64)s2 & 7)){
+    while(n > 0 && !WALIGNED(s1)){
+      if(*s1 != *s2)
+        return *s1 - *s2;
+      s1++, s2++, n--;
+    }
+    // skip the equal words; the bytes below find the difference
+    while(n >= 8 && *(const uint64 *)s1 == *(const uint64 *)s2)
+      s1 += 8, s2 += 8, n -= 8;
+  }
   while(n-- > 0){
     if(*s1 != *s2)
       return *s1 - *s2;
@@ -32,20 +68,59 @@ memmove(void *dst, const void *src, uint n)
 {
   const char *s;
   char *d;
+  const uint64 *ws;
+  uint64 *wd;
+  int words;
 
   if(n == 0)
     return dst;
   
   s = src;
   d = dst;
+  words = ((uint64)s & 7) == ((uint64)d & 7);
   if(s < d && s + n > d){
+    // overlapping, with dst above src: copy from the end down
     s += n;
     d += n;
+    if(words){
+      while(n > 0 && !WALIGNED(d)){
+        *--d = *--s;
+        n--;
+      }
+      ws = (const uint64 *) s;
+      wd = (uint64 *) d;
+      for(; n >= 64; n -= 64){
+        ws -= 8, wd -= 8;
+        wd[7] = ws[7]; wd[6] = ws[6]; wd[5] = ws[5]; wd[4] = ws[4];
+        wd[3] = ws[3]; wd[2] = ws[2]; wd[1] = ws[1]; wd[0] = ws[0];
+      }
+      for(; n >= 8; n -= 8)
+        *--wd = *--ws;
+      s = (const char *) ws;
+      d = (char *) wd;
+    }
     while(n-- > 0)
       *--d = *--s;
-  } else
+  } else {
+    if(words){
+      while(n > 0 && !WALIGNED(d)){
+        *d++ = *s++;
+        n--;
+      }
+      ws = (const uint64 *) s;
+      wd = (uint64 *) d;
+      for(; n >= 64; n -= 64, ws += 8, wd += 8){
+        wd[0] = ws[0]; wd[1] = ws[1]; wd[2] = ws[2]; wd[3] = ws[3];
+        wd[4] = ws[4]; wd[5] = ws[5]; wd[6] = ws[6]; wd[7] = ws[7];
+      }
+      for(; n >= 8; n -= 8)
+        *wd++ = *ws++;
+      s = (const char *) ws;
+      d = (char *) wd;
+    }
     while(n-- > 0)
       *d++ = *s++;
+  }
 
   return dst;
 }
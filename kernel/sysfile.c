@@ -8,6 +8,7 @@
 #include "riscv.h"
 #include "defs.h"
 #include "param.h"
+#include "memlayout.h"
 #include "stat.h"
 #include "spinlock.h"
 #include "proc.h"
@@ -15,6 +16,7 @@
 #include "sleeplock.h"
 #include "file.h"
 #include "fcntl.h"
+#include "spawn.h"
 
 // Fetch the nth word-sized system call argument as a file descriptor
 // and return both the descriptor and the corresponding struct file.
@@ -355,6 +357,9 @@ sys_open(void)
   } else {
     f->type = FD_INODE;
     f->off = 0;
+    f->ra_next = 0;
+    f->ra_win = 0;
+    f->ra_end = 0;
   }
   f->ip = ip;
   f->readable = !(omode & O_WRONLY);
@@ -431,24 +436,22 @@ sys_chdir(void)
   return 0;
 }
 
-uint64
-sys_exec(void)
+// Copy the user argument vector at uargv into argv,
+// one kalloc()ed page per string.
+// Returns 0, or -1 leaving argv for freeargv().
+static int
+fetchargv(uint64 uargv, char **argv)
 {
-  char path[MAXPATH], *argv[MAXARG];
   int i;
-  uint64 uargv, uarg;
+  uint64 uarg;
 
-  argaddr(1, &uargv);
-  if(argstr(0, path, MAXPATH) < 0) {
-    return -1;
-  }
-  memset(argv, 0, sizeof(argv));
+  memset(argv, 0, MAXARG*sizeof(char*));
   for(i=0;; i++){
-    if(i >= NELEM(argv)){
-      goto bad;
+    if(i >= MAXARG){
+      return -1;
     }
     if(fetchaddr(uargv+sizeof(uint64)*i, (uint64*)&uarg) < 0){
-      goto bad;
+      return -1;
     }
     if(uarg == 0){
       argv[i] = 0;
@@ -456,22 +459,62 @@ sys_exec(void)
     }
     argv[i] = kalloc();
     if(argv[i] == 0)
-      goto bad;
+      return -1;
     if(fetchstr(uarg, argv[i], PGSIZE) < 0)
-      goto bad;
+      return -1;
   }
+  return 0;
+}
 
-  int ret = exec(path, argv);
+static void
+freeargv(char **argv)
+{
+  int i;
 
-  for(i = 0; i < NELEM(argv) && argv[i] != 0; i++)
+  for(i = 0; i < MAXARG && argv[i] != 0; i++)
     kfree(argv[i]);
+}
 
+uint64
+sys_exec(void)
+{
+  char path[MAXPATH], *argv[MAXARG];
+  uint64 uargv;
+  int ret = -1;
+
+  argaddr(1, &uargv);
+  if(argstr(0, path, MAXPATH) < 0) {
+    return -1;
+  }
+  if(fetchargv(uargv, argv) == 0)
+    ret = exec(path, argv);
+  freeargv(argv);
   return ret;
+}
 
- bad:
-  for(i = 0; i < NELEM(argv) && argv[i] != 0; i++)
-    kfree(argv[i]);
-  return -1;
+uint64
+sys_spawn(void)
+{
+  char path[MAXPATH], *argv[MAXARG];
+  struct spawn_action act[MAXSPAWNACT];
+  uint64 uargv, uact;
+  int nact;
+  int ret = -1;
+
+  argaddr(1, &uargv);
+  argaddr(2, &uact);
+  argint(3, &nact);
+  if(argstr(0, path, MAXPATH) < 0) {
+    return -1;
+  }
+  if(nact < 0 || nact > MAXSPAWNACT)
+    return -1;
+  if(nact > 0 && copyin(myproc()->pagetable, (char*)act, uact, nact*sizeof(act[0]), 1) < 0)
+    return -1;
+  if(fetchargv(uargv, argv) == 0)
+    ret = spawn(path, argv, act, nact);
+  freeargv(argv);
+  return ret;
 }
 
 uint64
@@ -493,8 +536,8 @@ sys_pipe(void)
     fileclose(wf);
     return -1;
   }
-  if(copyout(p->pagetable, fdarray, (char*)&fd0, sizeof(fd0)) < 0 ||
-     copyout(p->pagetable, fdarray+sizeof(fd0), (char *)&fd1, sizeof(fd1)) < 0){
+  if(copyout(p->pagetable, fdarray, (char*)&fd0, sizeof(fd0), 1) < 0 ||
+     copyout(p->pagetable, fdarray+sizeof(fd0), (char *)&fd1, sizeof(fd1), 1) < 0){
     p->ofile[fd0] = 0;
     p->ofile[fd1] = 0;
     fileclose(rf);
@@ -505,18 +548,27 @@ sys_pipe(void)
 }
 
 
+// blocks of mapped pages one write-back transaction may write:
+// MAXOPBLOCKS less the inode block. the pages lie inside the file,
+// so no block is allocated and no bitmap or indirect block is
+// written (see write_page).
+#define WB_MAXBLOCKS (MAXOPBLOCKS-1)
+
 /*
 void *mmap(void *addr, size_t len, int prot, int flags,
            int fd, off_t offset)
 */
+static int mmap_can_merge(struct vm_area * area, struct file * fptr, int prot, int flags);
 uint64 sys_mmap(void) {
   // get input and check if input is valid
-  uint64 len;
+  uint64 addr, len, offset;
   int prot, flags, fd;
+  argaddr(0, &addr);
   argaddr(1, &len);
   argint(2, &prot);
   argint(3, &flags);
   argint(4, &fd);
+  argaddr(5, &offset);
   struct proc* self = myproc();
 
   if (len <= 0 || len % PGSIZE != 0) {
@@ -524,81 +576,153 @@ uint64 sys_mmap(void) {
     return -1;
   }
 
-  if (fd < 0 || fd >= NOFILE) {
-    printf("sys_mmap: fd = %d is not a valid number\n", fd);
-    return -1;
-  }
-
-  struct file * fptr = self->ofile[fd];
-  if (fptr == NULL) {
-    printf("sys_mmap: fd = %d is bind to null\n", fd);
-    return -1;
-  }
+  struct file * fptr = NULL;
+  if (flags & MAP_ANONYMOUS) {
+    // anonymous memory is zero-filled on demand and has no file,
+    // so there is nothing to share it through
+    if ((flags & MAP_SHARED) || !(flags & MAP_PRIVATE)) {
+      printf("sys_mmap: anonymous mapping must be MAP_PRIVATE\n");
+      return -1;
+    }
+  } else {
+    // the file offset must be page aligned and the window must fit in
+    // the 32-bit offsets the file system uses
+    if (offset % PGSIZE != 0 || offset + len < offset || offset + len > 0x100000000L) {
+      printf("sys_mmap: offset = %ld is not a valid number\n", offset);
+      return -1;
+    }
 
-  // check file type being f->type == FD_INODE
-  // check file's offset is 0
-  if (fptr->type != FD_INODE) {
-    printf("sys_mmap: fd = %d is not bind to a file\n", fd);
-    return -1;
-  }
+    if (fd < 0 || fd >= NOFILE) {
+      printf("sys_mmap: fd = %d is not a valid number\n", fd);
+      return -1;
+    }
 
-  // check RD compitible
-  if ((prot & PROT_WRITE) && (flags & MAP_SHARED) && (fptr->writable == 0)) {
-    printf("sys_mmap: fd = %d is not writable\n", fd);
-    return -1;
-  }
+    fptr = self->ofile[fd];
+    if (fptr == NULL) {
+      printf("sys_mmap: fd = %d is bind to null\n", fd);
+      return -1;
+    }
 
+    // check file type being f->type == FD_INODE
+    // check file's offset is 0
+    if (fptr->type != FD_INODE) {
+      printf("sys_mmap: fd = %d is not bind to a file\n", fd);
+      return -1;
+    }
 
-  // find a unused va
-  int slot = 0;
-  while (slot < NVMA && self->vm_areas[slot].length != 0) {
-    slot += 1;
+    // check RD compitible
+    if ((prot & PROT_WRITE) && (flags & MAP_SHARED) && (fptr->writable == 0)) {
+      printf("sys_mmap: fd = %d is not writable\n", fd);
+      return -1;
+    }
   }
 
-  if (slot >= NVMA) {
-    printf("sys_mmap: vm_areas are full\n");
+
+  // use the hinted address when that range is free, otherwise the
+  // highest hole between the heap and MMAPTOP that is big enough,
+  // so unmapped ranges are reused and the mappings stay packed
+  uint64 floor = PGROUNDUP(self->sz);
+  uint64 start;
+  if (addr != 0 && addr % PGSIZE == 0 && addr >= floor &&
+      addr + len > addr && addr + len <= MMAPTOP &&
+      vma_range_free(self, addr, len)) {
+    start = addr;
+  } else if ((start = vma_hole(self, len, floor, MMAPTOP)) == 0) {
+    printf("sys_mmap: no room in the address space\n");
     return -1;
   }
-  struct vm_area *area = self->vm_areas + slot;
 
-  // add reference to the fd, update file reference, one shall check if fd is valid
-  // when fail one must call close
-  filedup(fptr);
-  area->fptr = fptr; // release when fail
+  // an anonymous area uses its address as offset, so adjacent
+  // anonymous areas always look contiguous and can merge
+  if (fptr == NULL) {
+    offset = start;
+  }
 
-  // get current proc, and use proc->size to find a unused region
-  // we shall make start pasize alignment
-  if (self->next_start == 0) {
-    self->next_start = PGROUNDUP(self->sz);
+  // extend a neighboring area that maps the adjacent part of the same
+  // file the same way, instead of adding one more area
+  struct vm_area *prev = vma_find(self, start - 1);
+  struct vm_area *next = vma_find(self, start + len);
+  if (!mmap_can_merge(prev, fptr, prot, flags) || prev->offset + prev->length != offset) {
+    prev = NULL;
   }
-  if (self->next_start < self->sz) panic("sys_mmap: memory crash");
-  uint64 start = self->next_start;
-  uint64 end = start + len;
-  if (end <= start) {
-    printf("sys_mmap: address overflow\n");
-    area->fptr = NULL;
-    fileclose(fptr);
+  if (!mmap_can_merge(next, fptr, prot, flags) || offset + len != next->offset) {
+    next = NULL;
+  }
+  if (prev != NULL) {
+    prev->length += len;
+    if (next != NULL) {
+      // the new range fills the hole between them
+      prev->length += next->length;
+      if (next->fptr != NULL) {
+        fileclose(next->fptr);
+      }
+      vma_remove(self, next);
+    }
+    return start;
+  }
+  if (next != NULL) {
+    next->start_addr = start;
+    next->offset = offset;
+    next->length += len;
+    return start;
+  }
+
+  struct vm_area *area = vma_alloc();
+  if (area == NULL) {
+    printf("sys_mmap: out of memory for vm area\n");
     return -1;
   }
-  self->next_start = end;
 
   // add a VMA to the process's table of mapped regions
   area->start_addr = start;
   area->length = len;
   area->flags = flags;
   area->prot = prot;
-  area->valid_start = start;
-  area->valid_end = start + len;
+  area->offset = offset;
+  area->file_end = (uint64) -1;
+  area->ra_next = 0;
+  area->ra_pages = 0;
+  area->advice = MADV_NORMAL;
+  area->fptr = fptr;
+  if (vma_insert(self, area) < 0) {
+    printf("sys_mmap: vm areas are full\n");
+    vma_free(area);
+    return -1;
+  }
+
+  // add reference to the fd, update file reference
+  if (fptr != NULL) {
+    filedup(fptr);
+  }
 
-  printf("sys_mmap size of proc: %lx, start_addr: %lx, end_addr: %lx\n", self->sz, start, start + len);
   // fill other part of the vma
   return start;
 }
 
 
+// can a new mapping of fptr with prot and flags be added to area?
+static int mmap_can_merge(struct vm_area * area, struct file * fptr, int prot, int flags) {
+  return area != NULL &&
+    area->image == 0 &&
+    area->fptr == fptr &&
+    area->prot == prot &&
+    area->flags == flags &&
+    area->advice == MADV_NORMAL;
+}
+
+
 // int munmap(void *addr, size_t len);
 void write_back(pagetable_t pagetable, struct file * fptr, uint64 addr, uint64 len, uint64 offset);
 void put_back(pagetable_t pagetable, uint64 addr, uint64 len);
+static int mmap_map_page(pagetable_t pagetable, struct vm_area * area, uint64 pgaddr, int perm);
+static int mmap_perm(struct vm_area * area);
+static int mmap_anon_fault(pagetable_t pagetable, struct vm_area * area, uint64 pgaddr, int perm, int write);
+static int mmap_fault(struct proc * proc, struct vm_area * area, uint64 pgaddr, int write);
+static void mmap_populate(pagetable_t pagetable, struct vm_area * area, uint64 start, uint64 end);
+static void mmap_drop_clean(pagetable_t pagetable, struct vm_area * area, uint64 addr, uint64 len);
+static void msync_area(pagetable_t pagetable, struct vm_area * area, uint64 start, uint64 end, int wait);
+static void write_page(struct inode * ip, uint64 pa, uint64 offset, int * room);
+static void write_done(struct inode * ip, int * room);
 uint64 sys_munmap(void) {
   // parse parameters
   uint64 addr, len;
@@ -612,188 +736,513 @@ uint64 sys_munmap(void) {
   }
   
   // get the memory range to release
-  int slot = 0;
   struct proc * proc = myproc();
-  struct vm_area * area = proc->vm_areas;
-  while (slot < NVMA) {
-    if (
-      area->length != 0 &&
-      area->valid_start <= addr &&
-      addr + len <= area->valid_end
-    ) {
-      break;
-    }
-    slot += 1;
-    area += 1;
-  }
+  struct vm_area * area = vma_find(proc, addr);
 
   // check if vma found
-  if (slot >= NVMA) {
+  if (area == NULL || addr + len > area->start_addr + area->length) {
     printf("sys_munmap: range not in vm area\n");
     return -1;
   }
+  // the program's own segments go away with sbrk or exec
+  if (area->image) {
+    printf("sys_munmap: range is part of the program image\n");
+    return -1;
+  }
+  if (len == 0) {
+    return 0;
+  }
 
+  // superpages the range cuts through are split, so that only
+  // the range is released
+  if (uvmsplit(proc->pagetable, addr) != 0 || uvmsplit(proc->pagetable, addr + len) != 0) {
+    printf("sys_munmap: cannot split superpage\n");
+    return -1;
+  }
 
-  // change valid_start or valid_end
-  // [addr, addr+len] removed
-  if (area->valid_start == addr) {
-    area->valid_start = addr + len;
+  // split off the parts of the area outside [addr, addr+len), which
+  // may leave a hole in the middle of the old area, so that what is
+  // left is exactly the range to release
+  if (area->start_addr < addr) {
+    if ((area = vma_split(proc, area, addr)) == NULL) {
+      printf("sys_munmap: cannot split vm area\n");
+      return -1;
+    }
   }
-  // [valid_end - len, valid_end] removed
-  else if (addr + len == area->valid_end) {
-    area->valid_end -= len;
+  if (addr + len < area->start_addr + area->length) {
+    if (vma_split(proc, area, addr + len) == NULL) {
+      printf("sys_munmap: cannot split vm area\n");
+      return -1;
+    }
+  }
+
+  // write the pages back to the file or free them, and release the area
+  clear_vm_area(area, proc->pagetable);
+  vma_remove(proc, area);
+
+  return 0;
+}
+
+
+// int madvise(void *addr, size_t len, int advice);
+uint64 sys_madvise(void) {
+  uint64 addr, len;
+  int advice;
+  argaddr(0, &addr);
+  argaddr(1, &len);
+  argint(2, &advice);
+
+  if (addr % PGSIZE != 0 || addr + len < addr) {
+    printf("sys_madvise: addr not page aligned\n");
+    return -1;
   }
-  else {
-    printf("sys_munmap: cannot make a whole in vm area\n");
+  if (advice < MADV_NORMAL || advice > MADV_DONTNEED) {
+    printf("sys_madvise: advice = %d is not valid\n", advice);
     return -1;
   }
+  len = PGROUNDUP(len);
 
-  // write the page back to memory 
-  if (area->flags & MAP_SHARED) {
-    uint64 offset = addr - area->start_addr;
-    // printf("clear page range [%lx, %lx) in [%lx, %lx]\n", addr, addr+len, area->start_addr, area->start_addr + area->length);
-    write_back(proc->pagetable, area->fptr, addr, len, offset);
+  // apply the advice to every area overlapping [addr, addr+len)
+  int found = 0;
+  struct proc * proc = myproc();
+  for (struct vm_area * area = vma_next(proc, addr);
+       area != NULL && area->start_addr < addr + len;
+       area = vma_next(proc, area->start_addr + area->length)) {
+    uint64 start = area->start_addr;
+    uint64 end = area->start_addr + area->length;
+    found = 1;
+    if (start < addr) {
+      start = addr;
+    }
+    if (end > addr + len) {
+      end = addr + len;
+    }
+
+    switch (advice) {
+    case MADV_NORMAL:
+    case MADV_RANDOM:
+    case MADV_SEQUENTIAL:
+      // the access pattern drives the fault-around window. it is
+      // kept per area, so it must be given for whole areas
+      if (start != area->start_addr || end != area->start_addr + area->length) {
+        printf("sys_madvise: range covers part of a vm area\n");
+        return -1;
+      }
+      area->advice = advice;
+      area->ra_pages = 0;
+      break;
+    case MADV_WILLNEED:
+      // there is no kernel thread to read in the background, so
+      // read the pages now and spare the process the faults later.
+      // anonymous memory has nothing to read.
+      if (area->fptr == NULL) {
+        break;
+      }
+      ilock(area->fptr->ip);
+      mmap_populate(proc->pagetable, area, start, end);
+      iunlock(area->fptr->ip);
+      break;
+    case MADV_DONTNEED:
+      // drop the pages; shared ones are written back first and
+      // private ones are read again from the file on the next access
+      if (area->flags & MAP_SHARED) {
+        write_back(proc->pagetable, area->fptr, start, end - start, area->offset + (start - area->start_addr));
+      } else {
+        if (uvmsplit(proc->pagetable, start) != 0 || uvmsplit(proc->pagetable, end) != 0) {
+          printf("sys_madvise: cannot split superpage\n");
+          return -1;
+        }
+        put_back(proc->pagetable, start, end - start);
+      }
+      break;
+    }
+  }
+
+  if (!found) {
+    printf("sys_madvise: range not in vm area\n");
+    return -1;
+  }
+  return 0;
+}
+
+
+// int msync(void *addr, size_t len, int flags);
+uint64 sys_msync(void) {
+  uint64 addr, len;
+  int flags;
+  argaddr(0, &addr);
+  argaddr(1, &len);
+  argint(2, &flags);
+
+  if (addr % PGSIZE != 0 || addr + len < addr) {
+    printf("sys_msync: addr not page aligned\n");
+    return -1;
   }
-  else {
-    // unintall pages
-    put_back(proc->pagetable, addr, len);
+  if ((flags & ~(MS_ASYNC | MS_INVALIDATE | MS_SYNC)) != 0 ||
+      ((flags & MS_ASYNC) && (flags & MS_SYNC))) {
+    printf("sys_msync: flags = %d is not valid\n", flags);
+    return -1;
   }
+  len = PGROUNDUP(len);
 
-  // when all memory release one should release vm area
-  if (area->valid_start >= area->valid_end) {
-    clear_vm_area(area, proc->pagetable);
+  int found = 0;
+  struct proc * proc = myproc();
+  for (struct vm_area * area = vma_next(proc, addr);
+       area != NULL && area->start_addr < addr + len;
+       area = vma_next(proc, area->start_addr + area->length)) {
+    uint64 start = area->start_addr;
+    uint64 end = area->start_addr + area->length;
+    found = 1;
+    // private mappings are never written to the file, and the
+    // page cache keeps shared mappings coherent, so MS_INVALIDATE
+    // has nothing to do
+    if ((area->flags & MAP_SHARED) == 0) {
+      continue;
+    }
+    if (start < addr) {
+      start = addr;
+    }
+    if (end > addr + len) {
+      end = addr + len;
+    }
+    msync_area(proc->pagetable, area, start, end, (flags & MS_ASYNC) == 0);
   }
 
+  if (!found) {
+    printf("sys_msync: range not in vm area\n");
+    return -1;
+  }
   return 0;
 }
 
+// flush the dirty pages of [start, end) of a shared area, keeping
+// them mapped. the dirty bit is cleared in place so that only pages
+// stored to after this call are written again. without wait the
+// pages are only queued in the page cache, to be written in the
+// background by pcflush(), or sooner by a synchronous msync or
+// munmap of any process mapping the file.
+static void msync_area(pagetable_t pagetable, struct vm_area * area, uint64 start, uint64 end, int wait) {
+  struct inode * ip = area->fptr->ip;
+  int room = 0;
+
+  for (uint64 pgaddr = start; pgaddr < end; pgaddr += PGSIZE) {
+    uint64 pa = walkaddr(pagetable, pgaddr);
+    if (pa == 0) {
+      continue;
+    }
+    uint64 offset = area->offset + (pgaddr - area->start_addr);
+    // shared areas are mapped page by page, never with superpages
+    pte_t * pte = walk(pagetable, pgaddr, 0);
+    // the TLB entry with the dirty bit set is flushed by the
+    // sfence.vma on the way back to user space
+    int dirty = (*pte & PTE_D) != 0;
+    *pte &= ~PTE_D;
+
+    if (!wait) {
+      if (dirty) {
+        pcsetdirty(ip, offset);
+      }
+      continue;
+    }
+
+    if (pcclrdirty(ip, offset)) {
+      dirty = 1;
+    }
+    if (dirty) {
+      write_page(ip, pa, offset, &room);
+    }
+  }
+  write_done(ip, &room);
+}
+
 
 /*
 // 1. if share bit set sync with disk
 // 2. decrement the reference count of the corresponding struct file
-// 3. clear the whole slot
+// the area keeps its range, which vma_remove() looks it up by; the
+// caller removes it right after
 */
 void clear_vm_area(struct vm_area * area, pagetable_t pagetable) {
   struct file * fptr = area->fptr;
-  // printf("clear page range [%lx, %lx) in [%lx, %lx]\n", area->valid_start, area->valid_end, area->start_addr, area->start_addr + area->length);
   // sync with disk
-  if (area->valid_start < area->valid_end) {
-    uint64 addr = area->valid_start;
-    uint64 len = area->valid_end - area->valid_start;
+  if (area->length > 0) {
+    uint64 addr = area->start_addr;
+    uint64 len = area->length;
     if (area->flags & MAP_SHARED) {
-      uint64 offset = addr - area->start_addr;
-      write_back(pagetable, area->fptr, addr, len, offset);
+      write_back(pagetable, area->fptr, addr, len, area->offset);
     }
     else {
       put_back(pagetable, addr, len);
     }
   }
 
-  fileclose(fptr);
-
-  // clear the slot
-  memset(area, 0, sizeof(struct vm_area));
+  if (fptr != NULL) {
+    fileclose(fptr);
+  }
+  area->fptr = NULL;
 }
 
 
 // assumption: ip is not locked
 // handle share case
+// the dirty pages are written in as few log transactions as possible,
+// each one filled up to WB_MAXBLOCKS, so unmapping a large dirty
+// mapping neither overflows the log nor commits once per page.
 void write_back(pagetable_t pagetable, struct file * fptr, uint64 addr, uint64 len, uint64 offset) {
   // sync
   struct inode * ip = fptr->ip;
-  begin_op();
-  ilock(ip);
+  int room = 0;
 
   /// assumption offset is page aligned
   if (offset % PGSIZE != 0) panic("write_back: pagsize not aligned");
-  // while (ip->size < offset) {
-  //   if (writei(ip, 0, (uint64) zpg, ip->size, PGSIZE) != PGSIZE) {
-  //     panic("write_back: writei zero page fail");
-  //   }
-  // }
-
-  // what if two process share a file? may need lock
-  for (uint64 pgaddr = addr; pgaddr < addr+len; pgaddr += PGSIZE) {
+
+  // the pages are shared through the page cache, so a store by any
+  // process sharing the file is written back by whichever one unmaps
+  for (uint64 pgaddr = addr; pgaddr < addr+len; pgaddr += PGSIZE, offset += PGSIZE) {
     // check if pgaddr loaded into the table, if yes write it back to disk (check dirty)
-    if (walkaddr(pagetable, pgaddr) != 0) {
+    uint64 pa = walkaddr(pagetable, pgaddr);
+    if (pa != 0) {
       pte_t* pte = walk(pagetable, pgaddr, 0);
-      if (
-        (PTE_FLAGS(*pte) & PTE_D) &&
-        offset < ip->size
-      )
-      {
-        uint nbyte = ip->size - offset;
-        // printf("try to write back for %d bytes\n", nbyte);
-        if (writei(ip, 0, PTE2PA(*pte), offset, nbyte) != nbyte) {
-          panic("write_back: writei fail");
-        }
+      // written through this mapping, or queued by msync(MS_ASYNC)
+      int dirty = pcclrdirty(ip, offset);
+      if (dirty || (PTE_FLAGS(*pte) & PTE_D)) {
+        write_page(ip, pa, offset, &room);
       }
 
-      // this page can remove
-      uvmunmap(pagetable, pgaddr, 1, 1);
+      // this page can remove, the page cache owns the physical page
+      uvmunmap(pagetable, pgaddr, 1, 0);
+      pcput(ip, offset);
+    }
+  }
+  write_done(ip, &room);
+}
 
-      offset += PGSIZE;
+// write the part of the page at pa that lies inside the file to the
+// file at offset. mmap never grows a file, so every block written is
+// already allocated and a transaction only logs the data blocks and
+// the inode. the write continues the transaction that has *room
+// blocks left, and starts new ones as it fills up. a partial block
+// at the end of the file counts as a whole one. *room is 0 when no
+// transaction is open; the caller ends the last one with write_done.
+static void write_page(struct inode * ip, uint64 pa, uint64 offset, int * room) {
+  uint done = 0;
+
+  while (done < PGSIZE) {
+    if (*room == 0) {
+      begin_op();
+      ilock(ip);
+      *room = WB_MAXBLOCKS;
+    }
+    uint off = offset + done;
+    if (off >= ip->size) {
+      break;
+    }
+    uint n = PGSIZE - done;
+    if (n > ip->size - off) {
+      n = ip->size - off;
+    }
+    if (n > *room * BSIZE - off % BSIZE) {
+      n = *room * BSIZE - off % BSIZE;
+    }
+    if (writei(ip, 0, pa + done, off, n) != n) {
+      panic("write_page: writei fail");
+    }
+    done += n;
+    *room -= (off % BSIZE + n + BSIZE - 1) / BSIZE;
+    if (*room == 0) {
+      iunlock(ip);
+      end_op();
     }
   }
-  iunlock(ip);
-  end_op();
+}
+
+// end the transaction left open by write_page, if any
+static void write_done(struct inode * ip, int * room) {
+  if (*room > 0) {
+    iunlock(ip);
+    end_op();
+  }
+  *room = 0;
 }
 
 // handle private case
 void put_back(pagetable_t pagetable, uint64 addr, uint64 len) {
-  for (uint64 pgaddr = addr; pgaddr < addr+len; pgaddr += PGSIZE) {
-    // check if pgaddr loaded into the table, if yes write it back to disk (check dirty)
-    if (walkaddr(pagetable, pgaddr) != 0) {
-      // this page can remove
-      uvmunmap(pagetable, pgaddr, 1, 1);
-    }
-  }
+  // the pages loaded into the table are removed, but the zero page
+  // is never freed; munmap split any superpage the range cuts through
+  uvmunmaplazy(pagetable, addr, len / PGSIZE, 1);
 }
 
 int mmap_load_instr() {
-  if (r_scause() != 0xd && r_scause() != 0xf) return -1; // failed
+  if (r_scause() != 0xc && r_scause() != 0xd && r_scause() != 0xf) return -1; // failed
   uint64 va = r_stval();
 
-  // get current proc and its pagetable
+  // get current proc
   struct proc * proc = myproc();
-  pagetable_t pagetable = proc->pagetable;
 
-  // get the page addr for va
-  uint64 pgaddr = PGROUNDDOWN(va);
-
-  // find the vm_area contains pgaddr
-  int slot = 0;
-  struct vm_area * area = proc->vm_areas;
-  while (slot < NVMA) {
-    if (
-      area->length != 0 &&
-      area->start_addr <= pgaddr &&
-      pgaddr < area->start_addr + area->length
-    ) {
-      break;
+  // find the vm_area contains va. not finding one is no error
+  // here, the fault may be for the heap (see usertrap)
+  struct vm_area * area = vma_find(proc, PGROUNDDOWN(va));
+  if (area == NULL) {
+    return -1;
+  }
+
+  // write an only readable page
+  if ((area->prot & PROT_WRITE) == 0 && r_scause() == 0xf) {
+    printf("try to write a readable page\n");
+    exit(-1);
+  }
+
+  // jump into a page that is not executable: the process is killed
+  if ((area->prot & PROT_EXEC) == 0 && r_scause() == 0xc) {
+    return -1;
+  }
+
+  return mmap_fault(proc, area, PGROUNDDOWN(va), r_scause() == 0xf);
+}
+
+// fault in the pages of areas in [va, va+len) that the kernel is
+// about to copy to (write) or from. faulting in a file page takes
+// the inode lock, so copyin and copyout do it themselves only when
+// their caller passes canfault; callers that copy holding locks
+// (fileread, filewrite, wait) do this first. pages that cannot be
+// faulted in are left for the copy to fail on.
+void mmap_prefault(uint64 va, uint64 len, int write) {
+  struct proc * proc = myproc();
+
+  if (va + len < va) {
+    return;
+  }
+  for (uint64 a = PGROUNDDOWN(va); a < va + len && a < MAXVA; a += PGSIZE) {
+    struct vm_area * area = vma_find(proc, a);
+    if (area == NULL) {
+      continue;
+    }
+    pte_t * pte = walk(proc->pagetable, a, 0);
+    if (pte != 0 && (*pte & PTE_V) && (!write || (*pte & (PTE_W | PTE_COW)))) {
+      continue;
     }
-    slot += 1;
-    area += 1;
+    if (write && (area->prot & PROT_WRITE) == 0) {
+      continue;
+    }
+    mmap_fault(proc, area, a, write);
+  }
+}
+
+// fault in the page at pgaddr of area, and the pages around it
+static int mmap_fault(struct proc * proc, struct vm_area * area, uint64 pgaddr, int write) {
+  pagetable_t pagetable = proc->pagetable;
+  int perm = mmap_perm(area);
+
+  // anonymous memory is not read from anywhere, no fault-around
+  if (area->fptr == NULL) {
+    return mmap_anon_fault(pagetable, area, pgaddr, perm, write);
   }
 
-  if (slot >= NVMA) {
-    printf("mmap_load_instr: va %lx not in any vm area\n", va);
+  // a page already mapped faults only when the access is not
+  // allowed by its permissions
+  pte_t * pte = walk(pagetable, pgaddr, 0);
+  if (pte != 0 && (*pte & PTE_V)) {
     return -1;
   }
 
-  // va not in valid range ? panic
-  if (va < area->valid_start || va >= area->valid_end) {
-    printf("mmap_load_instr: visit invalid memory\n");
-    exit(-1);
+  struct inode * ip = area->fptr->ip;
+  uint64 end = area->start_addr + area->length;
+
+  // choose the fault-around window. a fault right after the last
+  // window is a sequential scan: double the window and read ahead
+  // from the fault. otherwise use the default window aligned around
+  // the fault. madvise() can force either behavior.
+  uint64 win_start, win_end;
+  if (area->advice == MADV_RANDOM) {
+    area->ra_pages = 1;
+    win_start = pgaddr;
+  } else if (area->advice == MADV_SEQUENTIAL) {
+    area->ra_pages = MAXFAULTAROUND;
+    win_start = pgaddr;
+  } else if (pgaddr == area->ra_next && area->ra_pages > 0) {
+    area->ra_pages = area->ra_pages * 2 > MAXFAULTAROUND ? MAXFAULTAROUND : area->ra_pages * 2;
+    win_start = pgaddr;
+  } else {
+    area->ra_pages = FAULTAROUND;
+    win_start = pgaddr - (pgaddr - area->start_addr) % (FAULTAROUND * PGSIZE);
   }
+  win_end = win_start + area->ra_pages * PGSIZE;
+  if (win_end > end || win_end < win_start) {
+    win_end = end;
+  }
+  area->ra_next = win_end;
 
-  // write an only readable page
-  if ((area->prot & PROT_WRITE) == 0 && r_scause() == 0xf) {
-    printf("try to write a readable page\n");
-    exit(-1);
+  // the kernel may be copying to or from this process while it
+  // reads or writes the very file mapped here
+  if (holdingsleep(&ip->lock)) {
+    return -1;
+  }
+  ilock(ip);
+  if (mmap_map_page(pagetable, area, pgaddr, perm) != 0) {
+    iunlock(ip);
+    printf("mmap_fault: cannot map page %lx\n", pgaddr);
+    return -1;
+  }
+  mmap_populate(pagetable, area, win_start, win_end);
+  iunlock(ip);
+
+  // a sequential scan will not come back: drop the clean pages one
+  // window behind the fault so the scan does not pin the whole file.
+  if (area->advice == MADV_SEQUENTIAL) {
+    uint64 lag = 2 * (uint64) area->ra_pages * PGSIZE;
+    if (pgaddr >= area->start_addr + lag) {
+      mmap_drop_clean(pagetable, area, pgaddr - lag, area->ra_pages * PGSIZE);
+    }
   }
 
-  // read priority from vma
+  return 0;
+}
+
+// fault in a page of an anonymous area. reads map the shared zero
+// page read-only; a store, including one to the zero page, gets a
+// freshly zeroed page of its own. untouched pages cost no memory.
+// a store to an untouched superpage of a private area gets the
+// whole superpage, if contiguous memory is free.
+static int mmap_anon_fault(pagetable_t pagetable, struct vm_area * area, uint64 pgaddr, int perm, int write) {
+  pte_t * pte = walk(pagetable, pgaddr, 0);
+
+  if (pte != 0 && (*pte & PTE_V)) {
+    // only a store to the zero page, which is never part of a
+    // superpage, faults on a mapped page
+    if (!write || walkaddr(pagetable, pgaddr) != zeropage) {
+      return -1;
+    }
+    *pte = 0;
+  }
+
+  if (!write) {
+    if (mappages(pagetable, pgaddr, PGSIZE, zeropage, perm & ~PTE_W) == -1) {
+      printf("mmap_anon_fault: map page not success\n");
+      return -1;
+    }
+    return 0;
+  }
+
+  if ((area->flags & MAP_PRIVATE) &&
+      uvmlazysuper(pagetable, pgaddr, area->start_addr, area->start_addr + area->length, perm) == 0) {
+    return 0;
+  }
+
+  void * newpage = kalloc_zeroed();
+  if (newpage == NULL) {
+    printf("mmap_anon_fault: memory full\n");
+    return -1;
+  }
+  if (mappages(pagetable, pgaddr, PGSIZE, (uint64) newpage, perm) == -1) {
+    kfree(newpage);
+    printf("mmap_anon_fault: map page not success\n");
+    return -1;
+  }
+  return 0;
+}
+
+// page table permission for the pages of an area
+static int mmap_perm(struct vm_area * area) {
   int perm = PTE_U;
   if ((area->prot & PROT_READ)) {
     perm = perm | PTE_R;
@@ -801,46 +1250,122 @@ int mmap_load_instr() {
   if ((area->prot & PROT_WRITE)) {
     perm = perm | PTE_W;
   }
-  // X and None shall not supprted
+  if ((area->prot & PROT_EXEC)) {
+    perm = perm | PTE_X;
+  }
+  // None shall not supprted
+  return perm;
+}
+
+// map the pages of [start, end) of the area that are backed by the
+// file and not yet mapped, so the following accesses do not trap.
+// this is only an optimization, give up quietly when out of memory.
+// the caller holds the file's inode lock.
+static void mmap_populate(pagetable_t pagetable, struct vm_area * area, uint64 start, uint64 end) {
+  struct inode * ip = area->fptr->ip;
+  uint64 data_end = ip->size < area->file_end ? ip->size : area->file_end;
+  uint64 file_end = area->start_addr + (data_end > area->offset ? data_end - area->offset : 0);
+  int perm = mmap_perm(area);
+
+  for (uint64 a = start; a < end && a < file_end; a += PGSIZE) {
+    if (walkaddr(pagetable, a) != 0) {
+      continue;
+    }
+    if (mmap_map_page(pagetable, area, a, perm) != 0) {
+      break;
+    }
+  }
+}
+
+// unmap the pages of [addr, addr+len) in the area that were not
+// written. they can be faulted back in from the file later.
+static void mmap_drop_clean(pagetable_t pagetable, struct vm_area * area, uint64 addr, uint64 len) {
+  for (uint64 a = addr; a < addr + len; a += PGSIZE) {
+    if (walkaddr(pagetable, a) == 0) {
+      continue;
+    }
+    // file pages are never mapped with superpages
+    pte_t * pte = walk(pagetable, a, 0);
+    if (*pte & PTE_D) {
+      continue;
+    }
+    if (area->flags & MAP_SHARED) {
+      if (pcisdirty(area->fptr->ip, area->offset + (a - area->start_addr))) {
+        continue;
+      }
+      uvmunmap(pagetable, a, 1, 0);
+      pcput(area->fptr->ip, area->offset + (a - area->start_addr));
+    } else {
+      uvmunmap(pagetable, a, 1, 1);
+    }
+  }
+}
+
+// map the page at pgaddr of the area, reading it from the file.
+// fails quietly, fault-around calls it speculatively; the caller
+// reports a failed demand fault. the caller holds the file's inode lock.
+static int mmap_map_page(pagetable_t pagetable, struct vm_area * area, uint64 pgaddr, int perm) {
+  uint64 offset = area->offset + (pgaddr - area->start_addr);
+  struct inode * ip = area->fptr->ip;
+
+  // shared mappings map the page cache's copy of the file page,
+  // so every process mapping the file sees the same memory
+  if (area->flags & MAP_SHARED) {
+    char * pa = pcget(ip, offset);
+    if (pa == NULL) {
+      return -1;
+    }
+    if (mappages(pagetable, pgaddr, PGSIZE, (uint64) pa, perm) == -1) {
+      pcput(ip, offset);
+      return -1;
+    }
+    return 0;
+  }
+
+  // a private page that cannot be written (program text) is the
+  // same as the file's, so map the cached page itself, shared by
+  // everyone running the program. the mapping holds a reference to
+  // the page, not to the cache entry, and unmaps like a private page.
+  if ((area->prot & PROT_WRITE) == 0 &&
+      (offset + PGSIZE <= area->file_end || area->file_end >= ip->size)) {
+    char * pa = pcget(ip, offset);
+    if (pa != NULL) {
+      kdup(pa);
+      pcput(ip, offset);
+      if (mappages(pagetable, pgaddr, PGSIZE, (uint64) pa, perm) == -1) {
+        kfree(pa);
+        return -1;
+      }
+      return 0;
+    }
+    // cache full of mapped pages, fall back to a private copy
+  }
 
   // allocate a page for the pgaddr and map it to user pagetable
   void * newpage = kalloc();
   if (newpage == NULL) {
-    printf("mmap_load_instr: memory full\n");
     return -1;
   }
 
-  memset(newpage, 0, PGSIZE);
+  // case 1: offset >= filesize, noting need to read
+  // case 2: offset < filesize, but offset + pagesize > filesize
+  // case 3: offset < filesize && offset + pagesize <= filesize
+  // an exec image's data ends before the page does, the rest is bss
+  uint n = area->file_end - offset < PGSIZE ? area->file_end - offset : PGSIZE;
+  int got = 0;
+  if (offset < ip->size && offset < area->file_end &&
+      (got = readi(ip, 0, (uint64) newpage, offset, n)) <= 0) {
+    kfree(newpage);
+    return -1;
+  }
+  // only the part of the page past the data needs clearing
+  memset((char *) newpage + got, 0, PGSIZE - got);
 
-  printf("map page addr: %lx\n", pgaddr);
   if (mappages(pagetable, pgaddr, PGSIZE, (uint64) newpage, perm) == -1) {
     // resources: newpage
     kfree(newpage);
-    printf("mmap_load_instr: map page not success\n");
     return -1;
   }
 
-  printf("mappages done\n");
-
-  uint64 offset = pgaddr - area->start_addr; // not shrink start_add in unmmap
-  int read_bytes = 0;
-  struct inode * ip = area->fptr->ip;
-  ilock(ip);
-  // case 1: offset >= filesize, noting need to read
-  if (offset < ip->size) {
-    // case 2: offset < filesize, but offset + pagesize > filesize
-    // case 3: offset < filesize && offset + pagesize <= filesize
-    // load data from the file
-
-    if ((read_bytes = readi(area->fptr->ip, 0, (uint64) newpage, offset, PGSIZE)) == 0) {
-      // failed release resources
-      iunlock(area->fptr->ip);
-      printf("mmap_load_instr: read fail from the inode");
-      uvmunmap(pagetable, pgaddr, 1, 1);
-      return -1;
-    }
-  }
-
-  iunlock(area->fptr->ip);
   return 0;
-}
\ No newline at end of file
+}
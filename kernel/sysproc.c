@@ -32,6 +32,10 @@ sys_wait(void)
 {
   uint64 p;
   argaddr(0, &p);
+  // wait copies out the status holding spinlocks, where it
+  // cannot fault in a mapped page; do it now
+  if(p != 0)
+    mmap_prefault(p, sizeof(int), 1);
   return wait(p);
 }
 
@@ -70,11 +70,18 @@ usertrap(void)
     syscall();
   } else if((which_dev = devintr()) != 0){
     // ok
+  } else if(r_scause() == 0xf && uvmiscow(p->pagetable, r_stval())){
+    // store to a page shared copy-on-write by fork
+    if(uvmcow(p->pagetable, r_stval()) < 0)
+      setkilled(p);
   }
   // load page fault 
   else if (mmap_load_instr() == 0) {
     // trap hanlded by mmap ok
   
+  } else if((r_scause() == 0xd || r_scause() == 0xf) &&
+            uvmlazy(p, r_stval()) == 0){
+    // first touch of a heap page
   } else {
     printf("usertrap(): unexpected scause 0x%lx pid=%d\n", r_scause(), p->pid);
     printf("            sepc=0x%lx stval=0x%lx\n", r_sepc(), r_stval());
@@ -84,6 +91,9 @@ usertrap(void)
   if(killed(p))
     exit(-1);
 
+  // write pages queued by msync(MS_ASYNC) now and then
+  pcflush();
+
   // give up the CPU if this is a timer interrupt.
   if(which_dev == 2)
     yield();
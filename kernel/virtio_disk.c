@@ -46,7 +46,7 @@ static struct disk {
   // for use when completion interrupt arrives.
   // indexed by first descriptor index of chain.
   struct {
-    struct buf *b;
+    struct buf *b;   // first buf of the request
     char status;
   } info[NUM];
 
@@ -116,16 +116,15 @@ virtio_disk_init(void)
     panic("virtio disk has no queue 0");
   if(max < NUM)
     panic("virtio disk max queue too short");
+  if(MAXRUN + 2 > NUM)
+    panic("virtio disk MAXRUN");
 
   // allocate and zero queue memory.
-  disk.desc = kalloc();
-  disk.avail = kalloc();
-  disk.used = kalloc();
+  disk.desc = kalloc_zeroed();
+  disk.avail = kalloc_zeroed();
+  disk.used = kalloc_zeroed();
   if(!disk.desc || !disk.avail || !disk.used)
     panic("virtio disk kalloc");
-  memset(disk.desc, 0, PGSIZE);
-  memset(disk.avail, 0, PGSIZE);
-  memset(disk.used, 0, PGSIZE);
 
   // set queue size.
   *R(VIRTIO_MMIO_QUEUE_NUM) = NUM;
@@ -196,12 +195,11 @@ free_chain(int i)
   }
 }
 
-// allocate three descriptors (they need not be contiguous).
-// disk transfers always use three descriptors.
+// allocate n descriptors (they need not be contiguous).
 static int
-alloc3_desc(int *idx)
+alloc_descs(int *idx, int n)
 {
-  for(int i = 0; i < 3; i++){
+  for(int i = 0; i < n; i++){
     idx[i] = alloc_desc();
     if(idx[i] < 0){
       for(int j = 0; j < i; j++)
@@ -212,27 +210,42 @@ alloc3_desc(int *idx)
   return 0;
 }
 
+// Start reading (write=0) or writing the n buffers bufs[0..n),
+// which the caller has locked and which hold consecutive blocks
+// of the disk, as one request; return without waiting for the
+// disk. only if there are not enough free descriptors does it
+// sleep for some to be freed. virtio_disk_intr() clears each
+// buffer's b->disk when the request is done.
 void
-virtio_disk_rw(struct buf *b, int write)
+virtio_disk_start(struct buf **bufs, int n, int write)
 {
-  uint64 sector = b->blockno * (BSIZE / 512);
+  uint64 sector = bufs[0]->blockno * (BSIZE / 512);
+  int i;
+
+  if(n < 1 || n > MAXRUN)
+    panic("virtio_disk_start");
+  for(i = 1; i < n; i++){
+    if(bufs[i]->blockno != bufs[0]->blockno + i)
+      panic("virtio_disk_start: not consecutive");
+  }
 
   acquire(&disk.vdisk_lock);
 
   // the spec's Section 5.2 says that legacy block operations use
-  // three descriptors: one for type/reserved/sector, one for the
-  // data, one for a 1-byte status result.
+  // a descriptor for type/reserved/sector, then descriptors for
+  // the data, then one for a 1-byte status result. a request of
+  // n blocks has a data descriptor per block.
 
-  // allocate the three descriptors.
-  int idx[3];
+  // allocate the n+2 descriptors.
+  int idx[MAXRUN+2];
   while(1){
-    if(alloc3_desc(idx) == 0) {
+    if(alloc_descs(idx, n+2) == 0) {
       break;
     }
     sleep(&disk.free[0], &disk.vdisk_lock);
   }
 
-  // format the three descriptors.
+  // format the descriptors.
   // qemu's virtio-blk.c reads them.
 
   struct virtio_blk_req *buf0 = &disk.ops[idx[0]];
@@ -249,24 +262,31 @@ virtio_disk_rw(struct buf *b, int write)
   disk.desc[idx[0]].flags = VRING_DESC_F_NEXT;
   disk.desc[idx[0]].next = idx[1];
 
-  disk.desc[idx[1]].addr = (uint64) b->data;
-  disk.desc[idx[1]].len = BSIZE;
-  if(write)
-    disk.desc[idx[1]].flags = 0; // device reads b->data
-  else
-    disk.desc[idx[1]].flags = VRING_DESC_F_WRITE; // device writes b->data
-  disk.desc[idx[1]].flags |= VRING_DESC_F_NEXT;
-  disk.desc[idx[1]].next = idx[2];
+  for(i = 0; i < n; i++){
+    struct virtq_desc *d = &disk.desc[idx[i+1]];
+    d->addr = (uint64) bufs[i]->data;
+    d->len = BSIZE;
+    if(write)
+      d->flags = 0; // device reads b->data
+    else
+      d->flags = VRING_DESC_F_WRITE; // device writes b->data
+    d->flags |= VRING_DESC_F_NEXT;
+    d->next = idx[i+2];
+  }
 
   disk.info[idx[0]].status = 0xff; // device writes 0 on success
-  disk.desc[idx[2]].addr = (uint64) &disk.info[idx[0]].status;
-  disk.desc[idx[2]].len = 1;
-  disk.desc[idx[2]].flags = VRING_DESC_F_WRITE; // device writes the status
-  disk.desc[idx[2]].next = 0;
-
-  // record struct buf for virtio_disk_intr().
-  b->disk = 1;
-  disk.info[idx[0]].b = b;
+  disk.desc[idx[n+1]].addr = (uint64) &disk.info[idx[0]].status;
+  disk.desc[idx[n+1]].len = 1;
+  disk.desc[idx[n+1]].flags = VRING_DESC_F_WRITE; // device writes the status
+  disk.desc[idx[n+1]].next = 0;
+
+  // record the bufs for virtio_disk_intr(), chained
+  // through b->qnext.
+  for(i = 0; i < n; i++){
+    bufs[i]->disk = 1;
+    bufs[i]->qnext = i + 1 < n ? bufs[i+1] : 0;
+  }
+  disk.info[idx[0]].b = bufs[0];
 
   // tell the device the first index in our chain of descriptors.
   disk.avail->ring[disk.avail->idx % NUM] = idx[0];
@@ -280,20 +300,37 @@ virtio_disk_rw(struct buf *b, int write)
 
   *R(VIRTIO_MMIO_QUEUE_NOTIFY) = 0; // value is queue number
 
-  // Wait for virtio_disk_intr() to say request has finished.
+  release(&disk.vdisk_lock);
+}
+
+// Wait for the request started on b to finish.
+void
+virtio_disk_wait(struct buf *b)
+{
+  acquire(&disk.vdisk_lock);
   while(b->disk == 1) {
     sleep(b, &disk.vdisk_lock);
   }
-
-  disk.info[idx[0]].b = 0;
-  free_chain(idx[0]);
-
   release(&disk.vdisk_lock);
 }
 
+// Read or write b and wait for it.
+void
+virtio_disk_rw(struct buf *b, int write)
+{
+  virtio_disk_start(&b, 1, write);
+  virtio_disk_wait(b);
+}
+
+// Complete the requests the disk has finished. A buffer with a
+// done function is handed to it only after vdisk_lock is
+// released: done functions take buffer cache locks, and
+// vdisk_lock is never held while taking one.
 void
 virtio_disk_intr()
 {
+  struct buf *done = 0;
+
   acquire(&disk.vdisk_lock);
 
   // the device won't raise another interrupt until we tell it
@@ -307,7 +344,8 @@ virtio_disk_intr()
   __sync_synchronize();
 
   // the device increments disk.used->idx when it
-  // adds an entry to the used ring.
+  // adds an entry to the used ring. all the requests it has
+  // finished are completed here, however many there are.
 
   while(disk.used_idx != disk.used->idx){
     __sync_synchronize();
@@ -316,12 +354,29 @@ virtio_disk_intr()
     if(disk.info[id].status != 0)
       panic("virtio_disk_intr status");
 
-    struct buf *b = disk.info[id].b;
-    b->disk = 0;   // disk is done with buf
-    wakeup(b);
+    struct buf *b = disk.info[id].b, *next;
+    disk.info[id].b = 0;
+    free_chain(id);
+    for(; b; b = next){
+      next = b->qnext;
+      b->qnext = 0;
+      b->disk = 0;   // disk is done with buf
+      if(b->done){
+        b->qnext = done;
+        done = b;
+      } else {
+        wakeup(b);
+      }
+    }
 
     disk.used_idx += 1;
   }
 
   release(&disk.vdisk_lock);
+
+  for(struct buf *b = done, *next; b; b = next){
+    next = b->qnext;
+    b->qnext = 0;
+    b->done(b);
+  }
 }
@@ -3,6 +3,8 @@
 #include "memlayout.h"
 #include "elf.h"
 #include "riscv.h"
+#include "spinlock.h"
+#include "proc.h"
 #include "defs.h"
 #include "fs.h"
 
@@ -11,6 +13,10 @@
  */
 pagetable_t kernel_pagetable;
 
+// a page of zeros, mapped read-only wherever anonymous memory
+// has been read but not yet written.
+uint64 zeropage;
+
 extern char etext[];  // kernel.ld sets this to end of kernel code.
 
 extern char trampoline[]; // trampoline.S
@@ -21,8 +27,7 @@ kvmmake(void)
 {
   pagetable_t kpgtbl;
 
-  kpgtbl = (pagetable_t) kalloc();
-  memset(kpgtbl, 0, PGSIZE);
+  kpgtbl = (pagetable_t) kalloc_zeroed();
 
   // uart registers
   kvmmap(kpgtbl, UART0, UART0, PGSIZE, PTE_R | PTE_W);
@@ -37,6 +42,7 @@ kvmmake(void)
   kvmmap(kpgtbl, KERNBASE, KERNBASE, (uint64)etext-KERNBASE, PTE_R | PTE_X);
 
   // map kernel data and the physical RAM we'll make use of.
+  // most of it is mapped with superpages, see kvmmap.
   kvmmap(kpgtbl, (uint64)etext, (uint64)etext, PHYSTOP-(uint64)etext, PTE_R | PTE_W);
 
   // map the trampoline for trap entry/exit to
@@ -54,6 +60,8 @@ void
 kvminit(void)
 {
   kernel_pagetable = kvmmake();
+
+  zeropage = (uint64) kalloc_zeroed();
 }
 
 // Switch h/w page table register to the kernel's page table,
@@ -72,7 +80,9 @@ kvminithart()
 
 // Return the address of the PTE in page table pagetable
 // that corresponds to virtual address va.  If alloc!=0,
-// create any required page-table pages.
+// create any required page-table pages. If va lies in a
+// superpage, return its level-1 leaf PTE, and the level of
+// the PTE in *level if level is not 0.
 //
 // The risc-v Sv39 scheme has three levels of page-table
 // pages. A page-table page contains 512 64-bit PTEs.
@@ -82,26 +92,52 @@ kvminithart()
 //   21..29 -- 9 bits of level-1 index.
 //   12..20 -- 9 bits of level-0 index.
 //    0..11 -- 12 bits of byte offset within the page.
-pte_t *
-walk(pagetable_t pagetable, uint64 va, int alloc)
+static pte_t *
+walklevel(pagetable_t pagetable, uint64 va, int alloc, int *leaflevel)
 {
   if(va >= MAXVA)
     panic("walk");
 
+  if(leaflevel)
+    *leaflevel = 0;
   for(int level = 2; level > 0; level--) {
     pte_t *pte = &pagetable[PX(level, va)];
+    if((*pte & PTE_V) && (*pte & (PTE_R|PTE_W|PTE_X))) {
+      if(level != 1)
+        panic("walk: gigapage");
+      if(leaflevel)
+        *leaflevel = level;
+      return pte;
+    }
     if(*pte & PTE_V) {
       pagetable = (pagetable_t)PTE2PA(*pte);
     } else {
-      if(!alloc || (pagetable = (pde_t*)kalloc()) == 0)
+      if(!alloc || (pagetable = (pde_t*)kalloc_zeroed()) == 0)
         return 0;
-      memset(pagetable, 0, PGSIZE);
       *pte = PA2PTE(pagetable) | PTE_V;
     }
   }
   return &pagetable[PX(0, va)];
 }
 
+pte_t *
+walk(pagetable_t pagetable, uint64 va, int alloc)
+{
+  return walklevel(pagetable, va, alloc, 0);
+}
+
+// The physical address of the page at va, which is mapped
+// by pte at level.
+static uint64
+pteaddr(pte_t pte, int level, uint64 va)
+{
+  uint64 pa = PTE2PA(pte);
+
+  if(level > 0)
+    pa += PGROUNDDOWN(va) % SUPERPGSIZE;
+  return pa;
+}
+
 // Look up a virtual address, return the physical address,
 // or 0 if not mapped.
 // Can only be used to look up user pages.
@@ -110,29 +146,130 @@ walkaddr(pagetable_t pagetable, uint64 va)
 {
   pte_t *pte;
   uint64 pa;
+  int level;
 
   if(va >= MAXVA)
     return 0;
 
-  pte = walk(pagetable, va, 0);
+  pte = walklevel(pagetable, va, 0, &level);
   if(pte == 0)
     return 0;
   if((*pte & PTE_V) == 0)
     return 0;
   if((*pte & PTE_U) == 0)
     return 0;
-  pa = PTE2PA(*pte);
+  pa = pteaddr(*pte, level, va);
   return pa;
 }
 
 // add a mapping to the kernel page table.
 // only used when booting.
 // does not flush TLB or enable paging.
+// the parts of the range where va and pa are both aligned
+// to a superpage are mapped with superpages.
 void
 kvmmap(pagetable_t kpgtbl, uint64 va, uint64 pa, uint64 sz, int perm)
 {
-  if(mappages(kpgtbl, va, sz, pa, perm) != 0)
-    panic("kvmmap");
+  uint64 n;
+
+  while(sz > 0){
+    if(va % SUPERPGSIZE == 0 && pa % SUPERPGSIZE == 0 && sz >= SUPERPGSIZE){
+      if(mapsuperpage(kpgtbl, va, pa, perm) != 0)
+        panic("kvmmap");
+      n = SUPERPGSIZE;
+    } else {
+      n = SUPERPGSIZE - va % SUPERPGSIZE;
+      if(n > sz)
+        n = sz;
+      if(mappages(kpgtbl, va, n, pa, perm) != 0)
+        panic("kvmmap");
+    }
+    va += n;
+    pa += n;
+    sz -= n;
+  }
+}
+
+// Is the superpage at va, aligned to SUPERPGSIZE, free to be
+// mapped? It is if nothing in it is mapped; a page-table page
+// left empty by earlier unmaps does not count.
+static int
+superpagefree(pagetable_t pagetable, uint64 va)
+{
+  pte_t *pte = &pagetable[PX(2, va)];
+  pagetable_t l0;
+
+  if((*pte & PTE_V) == 0)
+    return 1;
+  if(*pte & (PTE_R|PTE_W|PTE_X))
+    return 0;
+  pte = &((pagetable_t)PTE2PA(*pte))[PX(1, va)];
+  if((*pte & PTE_V) == 0)
+    return 1;
+  if(*pte & (PTE_R|PTE_W|PTE_X))
+    return 0;
+  l0 = (pagetable_t)PTE2PA(*pte);
+  for(int i = 0; i < 512; i++){
+    if(l0[i] & PTE_V)
+      return 0;
+  }
+  return 1;
+}
+
+// Map the superpage at va to pa, both aligned to SUPERPGSIZE,
+// with a level-1 leaf PTE.
+// Returns 0 on success, -1 if something in the range is
+// already mapped or a page-table page couldn't be allocated.
+int
+mapsuperpage(pagetable_t pagetable, uint64 va, uint64 pa, int perm)
+{
+  pte_t *pte;
+
+  if(va % SUPERPGSIZE != 0 || pa % SUPERPGSIZE != 0)
+    panic("mapsuperpage: not aligned");
+  if(!superpagefree(pagetable, va))
+    return -1;
+
+  pte = &pagetable[PX(2, va)];
+  if((*pte & PTE_V) == 0){
+    pagetable_t l1 = (pagetable_t)kalloc_zeroed();
+    if(l1 == 0)
+      return -1;
+    *pte = PA2PTE(l1) | PTE_V;
+  }
+  pte = &((pagetable_t)PTE2PA(*pte))[PX(1, va)];
+  if(*pte & PTE_V){
+    // an empty page-table page
+    kfree((void*)PTE2PA(*pte));
+  }
+  *pte = PA2PTE(pa) | perm | PTE_V;
+  return 0;
+}
+
+// If va lies in a superpage, map it with a page-table page of
+// 4096-byte pages instead, with the same permissions, so that
+// part of it can be unmapped, shared or changed.
+// Returns 0 on success, -1 if out of memory.
+int
+uvmsplit(pagetable_t pagetable, uint64 va)
+{
+  pte_t *pte;
+  pagetable_t l0;
+  uint64 pa;
+  int level, i;
+
+  if(va >= MAXVA)
+    return 0;
+  pte = walklevel(pagetable, va, 0, &level);
+  if(pte == 0 || (*pte & PTE_V) == 0 || level == 0)
+    return 0;
+  if((l0 = (pagetable_t)kalloc()) == 0)
+    return -1;
+  pa = PTE2PA(*pte);
+  for(i = 0; i < 512; i++)
+    l0[i] = PA2PTE(pa + i*PGSIZE) | PTE_FLAGS(*pte);
+  *pte = PA2PTE(l0) | PTE_V;
+  return 0;
 }
 
 // Create PTEs for virtual addresses starting at va that refer to
@@ -171,26 +308,45 @@ mappages(pagetable_t pagetable, uint64 va, uint64 size, uint64 pa, int perm)
   return 0;
 }
 
-// Remove npages of mappings starting from va. va must be
-// page-aligned. The mappings must exist.
-// Optionally free the physical memory.
-void
-uvmunmap(pagetable_t pagetable, uint64 va, uint64 npages, int do_free)
+// Is the page at va of a process one that must be present?
+// The stack [stack, heap) is allocated by exec. The heap above
+// it is allocated page by page as it is touched (see uvmlazy),
+// and the exec image below it may be paged in from the file
+// (see mmap_fault()), so those may have pages never touched.
+static int
+uvmdense(uint64 va, uint64 stack, uint64 heap)
+{
+  return va >= stack && va < heap;
+}
+
+static void
+unmap(pagetable_t pagetable, uint64 va, uint64 npages, int do_free, int lazy)
 {
   uint64 a;
   pte_t *pte;
+  int level;
 
   if((va % PGSIZE) != 0)
     panic("uvmunmap: not aligned");
 
   for(a = va; a < va + npages*PGSIZE; a += PGSIZE){
-    if((pte = walk(pagetable, a, 0)) == 0)
-      panic("uvmunmap: walk");
-    if((*pte & PTE_V) == 0)
-      panic("uvmunmap: not mapped");
+    if((pte = walklevel(pagetable, a, 0, &level)) == 0 || (*pte & PTE_V) == 0){
+      if(!lazy)
+        panic("uvmunmap: not mapped");
+      continue;
+    }
+    if(level > 0 && a % SUPERPGSIZE == 0 && a + SUPERPGSIZE <= va + npages*PGSIZE){
+      if(do_free)
+        kfree_pages((void*)PTE2PA(*pte), SUPERPGORDER);
+      *pte = 0;
+      a += SUPERPGSIZE - PGSIZE;
+      continue;
+    }
+    if(level > 0)
+      panic("uvmunmap: part of a superpage");
     if(PTE_FLAGS(*pte) == PTE_V)
       panic("uvmunmap: not a leaf");
-    if(do_free){
+    if(do_free && PTE2PA(*pte) != zeropage){
       uint64 pa = PTE2PA(*pte);
       kfree((void*)pa);
     }
@@ -198,16 +354,35 @@ uvmunmap(pagetable_t pagetable, uint64 va, uint64 npages, int do_free)
   }
 }
 
+// Remove npages of mappings starting from va. va must be
+// page-aligned. The mappings must exist.
+// Optionally free the physical memory, except for the zero page.
+// Superpages must lie wholly inside or outside the range:
+// callers that unmap part of one split it first (see uvmsplit),
+// so that unmapping never needs memory.
+void
+uvmunmap(pagetable_t pagetable, uint64 va, uint64 npages, int do_free)
+{
+  unmap(pagetable, va, npages, do_free, 0);
+}
+
+// Like uvmunmap, for memory whose pages are allocated as they
+// are touched: pages never touched are skipped.
+void
+uvmunmaplazy(pagetable_t pagetable, uint64 va, uint64 npages, int do_free)
+{
+  unmap(pagetable, va, npages, do_free, 1);
+}
+
 // create an empty user page table.
 // returns 0 if out of memory.
 pagetable_t
 uvmcreate()
 {
   pagetable_t pagetable;
-  pagetable = (pagetable_t) kalloc();
+  pagetable = (pagetable_t) kalloc_zeroed();
   if(pagetable == 0)
     return 0;
-  memset(pagetable, 0, PGSIZE);
   return pagetable;
 }
 
@@ -221,8 +396,7 @@ uvmfirst(pagetable_t pagetable, uchar *src, uint sz)
 
   if(sz >= PGSIZE)
     panic("uvmfirst: more than a page");
-  mem = kalloc();
-  memset(mem, 0, PGSIZE);
+  mem = kalloc_zeroed();
   mappages(pagetable, 0, PGSIZE, (uint64)mem, PTE_W|PTE_R|PTE_X|PTE_U);
   memmove(mem, src, sz);
 }
@@ -240,12 +414,11 @@ uvmalloc(pagetable_t pagetable, uint64 oldsz, uint64 newsz, int xperm)
 
   oldsz = PGROUNDUP(oldsz);
   for(a = oldsz; a < newsz; a += PGSIZE){
-    mem = kalloc();
+    mem = kalloc_zeroed();
     if(mem == 0){
       uvmdealloc(pagetable, a, oldsz);
       return 0;
     }
-    memset(mem, 0, PGSIZE);
     if(mappages(pagetable, a, PGSIZE, (uint64)mem, PTE_R|PTE_U|xperm) != 0){
       kfree(mem);
       uvmdealloc(pagetable, a, oldsz);
@@ -255,6 +428,85 @@ uvmalloc(pagetable_t pagetable, uint64 oldsz, uint64 newsz, int xperm)
   return newsz;
 }
 
+// Map a zeroed superpage around va, if the superpage lies
+// wholly inside [start, end) and nothing in it is mapped yet.
+// A process that touches memory sparsely gets far more memory
+// this way than it uses, so superpages are only handed out
+// while plenty of memory is free.
+// Returns 0 on success, -1 if not or if there is no free
+// contiguous memory.
+int
+uvmlazysuper(pagetable_t pagetable, uint64 va, uint64 start, uint64 end, int perm)
+{
+  uint64 a = SUPERPGROUNDDOWN(va);
+  char *mem;
+
+  if(a < start || a + SUPERPGSIZE > end || a + SUPERPGSIZE > MAXVA)
+    return -1;
+  if(!superpagefree(pagetable, a))
+    return -1;
+  if(knfree() < SUPERPGFREE << SUPERPGORDER)
+    return -1;
+  if((mem = kalloc_pages(SUPERPGORDER)) == 0)
+    return -1;
+  memset(mem, 0, SUPERPGSIZE);
+  if(mapsuperpage(pagetable, a, (uint64)mem, perm) != 0){
+    kfree_pages(mem, SUPERPGORDER);
+    return -1;
+  }
+  return 0;
+}
+
+// Allocate a zeroed page for the address va below p->sz if p
+// has not touched it yet: sbrk only moves p->sz, and heap pages
+// are allocated on the first fault. Pages of the exec image
+// are not heap, they are read from the file (see mmap_fault()).
+// A superpage of the heap that has not been touched at all is
+// allocated whole.
+// Returns 0 on success, -1 if va is not such a page or out of memory.
+int
+uvmlazy(struct proc *p, uint64 va)
+{
+  pagetable_t pagetable = p->pagetable;
+  pte_t *pte;
+  char *mem;
+
+  if(va >= p->sz || va >= MAXVA || vma_find(p, va) != 0)
+    return -1;
+  va = PGROUNDDOWN(va);
+  if((pte = walk(pagetable, va, 0)) != 0 && (*pte & PTE_V))
+    return -1;  // present, or the stack guard page
+  if(vma_range_free(p, SUPERPGROUNDDOWN(va), SUPERPGSIZE) &&
+     uvmlazysuper(pagetable, va, 0, p->sz, PTE_R|PTE_U|PTE_W) == 0)
+    return 0;
+  if((mem = kalloc_zeroed()) == 0)
+    return -1;
+  if(mappages(pagetable, va, PGSIZE, (uint64)mem, PTE_R|PTE_U|PTE_W) != 0){
+    kfree(mem);
+    return -1;
+  }
+  return 0;
+}
+
+// Before the kernel copies to (write) or from va, fault it in if
+// it is a page of the current process that has not been touched.
+// A heap page is allocated without sleeping. A page of a mapping
+// is faulted in only if the caller says it may sleep (canfault),
+// since that reads the file holding its inode lock; a copy done
+// holding locks relies on its caller's mmap_prefault().
+static void
+uvmtouch(pagetable_t pagetable, uint64 va, int write, int canfault)
+{
+  struct proc *p = myproc();
+
+  if(p == 0 || pagetable != p->pagetable)
+    return;
+  if(uvmlazy(p, va) == 0)
+    return;
+  if(canfault)
+    mmap_prefault(va, 1, write);
+}
+
 // Deallocate user pages to bring the process size from oldsz to
 // newsz.  oldsz and newsz need not be page-aligned, nor does newsz
 // need to be less than oldsz.  oldsz can be larger than the actual
@@ -293,52 +545,231 @@ freewalk(pagetable_t pagetable)
   kfree((void*)pagetable);
 }
 
-// Free user memory pages,
-// then free page-table pages.
+// Unmap and free the user pages of [va, end), page-aligned, of
+// a process whose stack is [stack, heap): the stack pages must
+// be present, pages elsewhere may never have been touched.
+void
+uvmunmapproc(pagetable_t pagetable, uint64 va, uint64 end, uint64 stack, uint64 heap)
+{
+  uint64 next;
+
+  for(; va < end; va = next){
+    if(va < stack)
+      next = stack;
+    else if(va < heap)
+      next = heap;
+    else
+      next = end;
+    if(next > end)
+      next = end;
+    if(uvmdense(va, stack, heap))
+      uvmunmap(pagetable, va, (next - va)/PGSIZE, 1);
+    else
+      uvmunmaplazy(pagetable, va, (next - va)/PGSIZE, 1);
+  }
+}
+
+// Free user memory pages [0, sz) of a process whose stack
+// is [stack, heap), then free page-table pages.
 void
-uvmfree(pagetable_t pagetable, uint64 sz)
+uvmfree(pagetable_t pagetable, uint64 stack, uint64 heap, uint64 sz)
 {
-  if(sz > 0)
-    uvmunmap(pagetable, 0, PGROUNDUP(sz)/PGSIZE, 1);
+  uvmunmapproc(pagetable, 0, PGROUNDUP(sz), stack, heap);
   freewalk(pagetable);
 }
 
-// Given a parent process's page table, copy
-// its memory into a child's page table.
-// Copies both the page table and the
-// physical memory.
+// Share the page mapped at va by a parent's pte with a
+// child's page table, copy-on-write: a writable page becomes
+// read-only in both, marked PTE_COW, and is copied by the first
+// store (see uvmcow). The zero page is shared as it is.
+// returns 0 on success, -1 on failure.
+static int
+uvmshare(pagetable_t new, pte_t *pte, uint64 va)
+{
+  uint64 pa = PTE2PA(*pte);
+
+  if(*pte & PTE_W)
+    *pte = (*pte & ~PTE_W) | PTE_COW;
+  if(mappages(new, va, PGSIZE, pa, PTE_FLAGS(*pte)) != 0)
+    return -1;
+  if(pa != zeropage)
+    kdup((void*)pa);
+  return 0;
+}
+
+// Like uvmshare, for the superpage mapped at va by a parent's
+// level-1 pte: it is shared whole, each of its pages gaining
+// a reference, so either side can later split it.
+// returns 0 on success, -1 on failure.
+static int
+uvmsharesuper(pagetable_t new, pte_t *pte, uint64 va)
+{
+  uint64 pa = PTE2PA(*pte);
+
+  if(*pte & PTE_W)
+    *pte = (*pte & ~PTE_W) | PTE_COW;
+  if(mapsuperpage(new, va, pa, PTE_FLAGS(*pte)) != 0)
+    return -1;
+  for(int i = 0; i < 512; i++)
+    kdup((void*)(pa + i*PGSIZE));
+  return 0;
+}
+
+// Share the memory old maps at va with new, copy-on-write.
+// A superpage that starts at va and ends by end is shared
+// whole; one that does not is split.
+// Returns the number of pages shared, 0 if nothing is mapped
+// at va, or -1 if out of memory.
+static int
+uvmsharepage(pagetable_t old, pagetable_t new, uint64 va, uint64 end)
+{
+  pte_t *pte;
+  int level;
+
+  if((pte = walklevel(old, va, 0, &level)) == 0 || (*pte & PTE_V) == 0)
+    return 0;
+  if(level > 0){
+    if(va % SUPERPGSIZE == 0 && va + SUPERPGSIZE <= end)
+      return uvmsharesuper(new, pte, va) == 0 ? 512 : -1;
+    if(uvmsplit(old, va) != 0)
+      return -1;
+    pte = walk(old, va, 0);
+  }
+  return uvmshare(new, pte, va) == 0 ? 1 : -1;
+}
+
+// Given a parent process's page table, share
+// its memory with a child's page table.
+// Pages are copied later, when either process
+// writes them. Superpages are shared whole.
+// Pages of [0, sz) outside the stack [stack, heap) that were
+// never touched are skipped.
 // returns 0 on success, -1 on failure.
 // frees any allocated pages on failure.
 int
-uvmcopy(pagetable_t old, pagetable_t new, uint64 sz)
+uvmcopy(pagetable_t old, pagetable_t new, uint64 stack, uint64 heap, uint64 sz)
 {
-  pte_t *pte;
-  uint64 pa, i;
-  uint flags;
-  char *mem;
+  uint64 i;
+  int n;
 
-  for(i = 0; i < sz; i += PGSIZE){
-    if((pte = walk(old, i, 0)) == 0)
-      panic("uvmcopy: pte should exist");
-    if((*pte & PTE_V) == 0)
-      panic("uvmcopy: page not present");
-    pa = PTE2PA(*pte);
-    flags = PTE_FLAGS(*pte);
-    if((mem = kalloc()) == 0)
-      goto err;
-    memmove(mem, (char*)pa, PGSIZE);
-    if(mappages(new, i, PGSIZE, (uint64)mem, flags) != 0){
-      kfree(mem);
+  for(i = 0; i < sz; i += n*PGSIZE){
+    if((n = uvmsharepage(old, new, i, sz)) < 0)
       goto err;
+    if(n == 0){
+      if(uvmdense(i, stack, heap))
+        panic("uvmcopy: page not present");
+      n = 1;  // not touched yet
     }
   }
   return 0;
 
  err:
-  uvmunmap(new, 0, i / PGSIZE, 1);
+  uvmunmaplazy(new, 0, i / PGSIZE, 1);
   return -1;
 }
 
+// Like uvmcopy, for the pages that are present in
+// [start, end), as fork does for private mappings.
+// Pages not yet faulted in are skipped.
+// returns 0 on success, -1 on failure; the caller unmaps
+// whatever was shared.
+int
+uvmcopyrange(pagetable_t old, pagetable_t new, uint64 start, uint64 end)
+{
+  uint64 i;
+  int n;
+
+  for(i = start; i < end; i += n*PGSIZE){
+    if((n = uvmsharepage(old, new, i, end)) < 0)
+      return -1;
+    if(n == 0)
+      n = 1;
+  }
+  return 0;
+}
+
+// Is va mapped to a copy-on-write page?
+int
+uvmiscow(pagetable_t pagetable, uint64 va)
+{
+  pte_t *pte;
+
+  if(va >= MAXVA)
+    return 0;
+  pte = walk(pagetable, va, 0);
+  return pte != 0 && (*pte & PTE_V) && (*pte & PTE_U) && (*pte & PTE_COW);
+}
+
+// Make the copy-on-write superpage mapped by the level-1 pte
+// writable, copying it whole unless no other page table refers
+// to any of its pages any more.
+// returns 0 on success, -1 if there is no contiguous memory.
+static int
+uvmcowsuper(pte_t *pte)
+{
+  uint64 pa = PTE2PA(*pte);
+  uint flags = (PTE_FLAGS(*pte) & ~PTE_COW) | PTE_W;
+  char *mem;
+  int i;
+
+  for(i = 0; i < 512; i++){
+    if(krefs((void*)(pa + i*PGSIZE)) != 1)
+      break;
+  }
+  if(i == 512){
+    *pte = PA2PTE(pa) | flags;
+    return 0;
+  }
+  if(knfree() < SUPERPGFREE << SUPERPGORDER)
+    return -1;
+  if((mem = kalloc_pages(SUPERPGORDER)) == 0)
+    return -1;
+  memmove(mem, (char*)pa, SUPERPGSIZE);
+  *pte = PA2PTE(mem) | flags;
+  kfree_pages((void*)pa, SUPERPGORDER);
+  return 0;
+}
+
+// Make the copy-on-write page at va writable, copying it
+// unless no other page table refers to it any more.
+// A copy-on-write superpage is copied whole if memory allows,
+// and split otherwise.
+// returns 0 on success, -1 if out of memory.
+int
+uvmcow(pagetable_t pagetable, uint64 va)
+{
+  pte_t *pte;
+  uint64 pa;
+  uint flags;
+  char *mem;
+  int level;
+
+  if(!uvmiscow(pagetable, va))
+    panic("uvmcow");
+  pte = walklevel(pagetable, va, 0, &level);
+  if(level > 0){
+    if(uvmcowsuper(pte) == 0)
+      return 0;
+    // no contiguous memory: copy just this page
+    if(uvmsplit(pagetable, va) != 0)
+      return -1;
+    pte = walk(pagetable, va, 0);
+  }
+  pa = PTE2PA(*pte);
+  flags = (PTE_FLAGS(*pte) & ~PTE_COW) | PTE_W;
+
+  if(krefs((void*)pa) == 1){
+    *pte = PA2PTE(pa) | flags;
+    return 0;
+  }
+  if((mem = kalloc()) == 0)
+    return -1;
+  memmove(mem, (char*)pa, PGSIZE);
+  *pte = PA2PTE(mem) | flags;
+  kfree((void*)pa);
+  return 0;
+}
+
 // mark a PTE invalid for user access.
 // used by exec for the user stack guard page.
 void
@@ -354,22 +785,29 @@ uvmclear(pagetable_t pagetable, uint64 va)
 
 // Copy from kernel to user.
 // Copy len bytes from src to virtual address dstva in a given page table.
+// canfault says whether the caller may sleep to fault in a mapped
+// page (see uvmtouch).
 // Return 0 on success, -1 on error.
 int
-copyout(pagetable_t pagetable, uint64 dstva, char *src, uint64 len)
+copyout(pagetable_t pagetable, uint64 dstva, char *src, uint64 len, int canfault)
 {
   uint64 n, va0, pa0;
   pte_t *pte;
+  int level;
 
   while(len > 0){
     va0 = PGROUNDDOWN(dstva);
     if(va0 >= MAXVA)
       return -1;
-    pte = walk(pagetable, va0, 0);
+    uvmtouch(pagetable, va0, 1, canfault);
+    if(uvmiscow(pagetable, va0) && uvmcow(pagetable, va0) < 0)
+      return -1;
+    pte = walklevel(pagetable, va0, 0, &level);
     if(pte == 0 || (*pte & PTE_V) == 0 || (*pte & PTE_U) == 0 ||
        (*pte & PTE_W) == 0)
       return -1;
-    pa0 = PTE2PA(*pte);
+    *pte |= PTE_D;  // as a store by the process would
+    pa0 = pteaddr(*pte, level, va0);
     n = PGSIZE - (dstva - va0);
     if(n > len)
       n = len;
@@ -384,14 +822,16 @@ copyout(pagetable_t pagetable, uint64 dstva, char *src, uint64 len)
 
 // Copy from user to kernel.
 // Copy len bytes to dst from virtual address srcva in a given page table.
+// canfault is as for copyout.
 // Return 0 on success, -1 on error.
 int
-copyin(pagetable_t pagetable, char *dst, uint64 srcva, uint64 len)
+copyin(pagetable_t pagetable, char *dst, uint64 srcva, uint64 len, int canfault)
 {
   uint64 n, va0, pa0;
 
   while(len > 0){
     va0 = PGROUNDDOWN(srcva);
+    uvmtouch(pagetable, va0, 0, canfault);
     pa0 = walkaddr(pagetable, va0);
     if(pa0 == 0)
       return -1;
@@ -409,16 +849,17 @@ copyin(pagetable_t pagetable, char *dst, uint64 srcva, uint64 len)
 
 // Copy a null-terminated string from user to kernel.
 // Copy bytes to dst from virtual address srcva in a given page table,
-// until a '\0', or max.
+// until a '\0', or max. canfault is as for copyout.
 // Return 0 on success, -1 on error.
 int
-copyinstr(pagetable_t pagetable, char *dst, uint64 srcva, uint64 max)
+copyinstr(pagetable_t pagetable, char *dst, uint64 srcva, uint64 max, int canfault)
 {
   uint64 n, va0, pa0;
   int got_null = 0;
 
   while(got_null == 0 && max > 0){
     va0 = PGROUNDDOWN(srcva);
+    uvmtouch(pagetable, va0, 0, canfault);
     pa0 = walkaddr(pagetable, va0);
     if(pa0 == 0)
       return -1;
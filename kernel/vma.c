@@ -0,0 +1,257 @@
+// Virtual memory areas of a process.
+//
+// struct vm_area objects come from a simple slab carved out of
+// pages from kalloc(). Each process keeps pointers to its areas in
+// one page, sorted by start address, so an area is found by binary
+// search; the last area found is remembered because repeated faults
+// tend to hit the same one.
+//
+// The areas of a process are private to it (like p->sz), so
+// only the slab needs a lock.
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "proc.h"
+#include "defs.h"
+
+struct vmarun {
+  struct vmarun *next;
+};
+
+struct {
+  struct spinlock lock;
+  struct vmarun *freelist;
+} vmaslab;
+
+void
+vmainit(void)
+{
+  initlock(&vmaslab.lock, "vmaslab");
+  if(NVMA * sizeof(struct vm_area*) > PGSIZE)
+    panic("vmainit: NVMA");
+}
+
+// Allocate a zeroed vm_area.
+// Returns 0 if out of memory.
+struct vm_area*
+vma_alloc(void)
+{
+  struct vmarun *r;
+  char *page;
+  int i;
+
+  acquire(&vmaslab.lock);
+  if(vmaslab.freelist == 0){
+    release(&vmaslab.lock);
+    if((page = kalloc()) == 0)
+      return 0;
+    acquire(&vmaslab.lock);
+    for(i = 0; i + sizeof(struct vm_area) <= PGSIZE; i += sizeof(struct vm_area)){
+      r = (struct vmarun*)(page + i);
+      r->next = vmaslab.freelist;
+      vmaslab.freelist = r;
+    }
+  }
+  r = vmaslab.freelist;
+  vmaslab.freelist = r->next;
+  release(&vmaslab.lock);
+
+  memset(r, 0, sizeof(struct vm_area));
+  return (struct vm_area*)r;
+}
+
+// Return a vm_area to the slab.
+void
+vma_free(struct vm_area *area)
+{
+  struct vmarun *r = (struct vmarun*)area;
+
+  acquire(&vmaslab.lock);
+  r->next = vmaslab.freelist;
+  vmaslab.freelist = r;
+  release(&vmaslab.lock);
+}
+
+// Index of the first area of p that ends above va,
+// or p->nvma if there is none.
+static int
+vma_search(struct proc *p, uint64 va)
+{
+  int lo = 0, hi = p->nvma;
+
+  while(lo < hi){
+    int mid = (lo + hi) / 2;
+    struct vm_area *a = p->vmas[mid];
+    if(a->start_addr + a->length <= va)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+// Return the area of p that contains va, or 0.
+struct vm_area*
+vma_find(struct proc *p, uint64 va)
+{
+  struct vm_area *a = p->vma_hit;
+  int i;
+
+  if(a && a->start_addr <= va && va < a->start_addr + a->length)
+    return a;
+
+  i = vma_search(p, va);
+  if(i < p->nvma && p->vmas[i]->start_addr <= va){
+    p->vma_hit = p->vmas[i];
+    return p->vmas[i];
+  }
+  return 0;
+}
+
+// Return the first area of p that ends above va, or 0.
+// Used to walk the areas overlapping a range in order.
+struct vm_area*
+vma_next(struct proc *p, uint64 va)
+{
+  int i = vma_search(p, va);
+
+  if(i < p->nvma)
+    return p->vmas[i];
+  return 0;
+}
+
+// Is [va, va+len) free of areas in p?
+int
+vma_range_free(struct proc *p, uint64 va, uint64 len)
+{
+  struct vm_area *a = vma_next(p, va);
+
+  return a == 0 || a->start_addr >= va + len;
+}
+
+// Find the highest free range of len bytes in [floor, top),
+// first fit from the top down.
+// Returns its start, or 0 if there is none.
+uint64
+vma_hole(struct proc *p, uint64 len, uint64 floor, uint64 top)
+{
+  uint64 end = top;
+  int i;
+
+  if(len == 0 || top < floor)
+    return 0;
+  for(i = vma_search(p, top) - 1; i >= 0; i--){
+    struct vm_area *a = p->vmas[i];
+    uint64 a_end = a->start_addr + a->length;
+    if(a_end < floor)
+      break;
+    if(a_end < end && end - a_end >= len)
+      return end - len;
+    if(a->start_addr < end)
+      end = a->start_addr;
+  }
+  if(end >= floor && end - floor >= len)
+    return end - len;
+  return 0;
+}
+
+// Allocate p's index if it has none yet, so that exec can
+// make sure inserting its areas will not run out of memory.
+// Returns -1 if out of memory.
+int
+vma_initindex(struct proc *p)
+{
+  if(p->vmas == 0){
+    if((p->vmas = (struct vm_area**)kalloc()) == 0)
+      return -1;
+  }
+  return 0;
+}
+
+// Add area to p's index.
+// Returns -1 if it overlaps another area, or if p has no room.
+int
+vma_insert(struct proc *p, struct vm_area *area)
+{
+  int i;
+
+  if(vma_initindex(p) < 0)
+    return -1;
+  if(p->nvma >= NVMA)
+    return -1;
+
+  i = vma_search(p, area->start_addr);
+  if(i < p->nvma && p->vmas[i]->start_addr < area->start_addr + area->length)
+    return -1;
+
+  memmove(&p->vmas[i+1], &p->vmas[i], (p->nvma - i) * sizeof(struct vm_area*));
+  p->vmas[i] = area;
+  p->nvma++;
+  return 0;
+}
+
+// Split area at va, a page boundary strictly inside it.
+// area keeps [start, va); the new area returned holds [va, end)
+// with its own reference to the file.
+// Returns 0 if out of memory or if p has no room.
+struct vm_area*
+vma_split(struct proc *p, struct vm_area *area, uint64 va)
+{
+  struct vm_area *upper;
+  uint64 end = area->start_addr + area->length;
+
+  if(va <= area->start_addr || va >= end || va % PGSIZE != 0)
+    panic("vma_split");
+  if((upper = vma_alloc()) == 0)
+    return 0;
+
+  *upper = *area;
+  upper->start_addr = va;
+  upper->length = end - va;
+  upper->offset += va - area->start_addr;
+  area->length = va - area->start_addr;
+  if(vma_insert(p, upper) < 0){
+    area->length = end - area->start_addr;
+    vma_free(upper);
+    return 0;
+  }
+  if(upper->fptr)
+    filedup(upper->fptr);
+  return upper;
+}
+
+// Remove area from p's index and free it.
+// area must still hold the range it was indexed by.
+void
+vma_remove(struct proc *p, struct vm_area *area)
+{
+  int i;
+
+  for(i = vma_search(p, area->start_addr); i < p->nvma; i++){
+    if(p->vmas[i] == area)
+      break;
+  }
+  if(i >= p->nvma)
+    panic("vma_remove");
+
+  memmove(&p->vmas[i], &p->vmas[i+1], (p->nvma - i - 1) * sizeof(struct vm_area*));
+  p->nvma--;
+  if(p->vma_hit == area)
+    p->vma_hit = 0;
+  vma_free(area);
+}
+
+// Free p's (empty) index.
+void
+vma_freeindex(struct proc *p)
+{
+  if(p->nvma != 0)
+    panic("vma_freeindex");
+  if(p->vmas)
+    kfree((void*)p->vmas);
+  p->vmas = 0;
+  p->vma_hit = 0;
+}
@@ -8,6 +8,7 @@
 #include "user/user.h"
 #include "kernel/fs.h"
 #include "kernel/fcntl.h"
+#include "kernel/spawn.h"
 #include "kernel/syscall.h"
 #include "kernel/memlayout.h"
 #include "kernel/riscv.h"
@@ -231,47 +232,29 @@ go(int which_child)
         fprintf(2, "grind: pipe failed\n");
         exit(1);
       }
-      int pid1 = fork();
-      if(pid1 == 0){
-        close(bb[0]);
-        close(bb[1]);
-        close(aa[0]);
-        close(1);
-        if(dup(aa[1]) != 1){
-          fprintf(2, "grind: dup failed\n");
-          exit(1);
-        }
-        close(aa[1]);
-        char *args[3] = { "echo", "hi", 0 };
-        exec("grindir/../echo", args);
-        fprintf(2, "grind: echo: not found\n");
-        exit(2);
-      } else if(pid1 < 0){
-        fprintf(2, "grind: fork failed\n");
+      struct spawn_action act1[] = {
+        { SPAWN_CLOSE, bb[0] },
+        { SPAWN_CLOSE, bb[1] },
+        { SPAWN_CLOSE, aa[0] },
+        { SPAWN_DUP2, aa[1], 1 },
+        { SPAWN_CLOSE, aa[1] },
+      };
+      char *args1[3] = { "echo", "hi", 0 };
+      if(spawn("grindir/../echo", args1, act1, sizeof(act1)/sizeof(act1[0])) < 0){
+        fprintf(2, "grind: spawn echo failed\n");
         exit(3);
       }
-      int pid2 = fork();
-      if(pid2 == 0){
-        close(aa[1]);
-        close(bb[0]);
-        close(0);
-        if(dup(aa[0]) != 0){
-          fprintf(2, "grind: dup failed\n");
-          exit(4);
-        }
-        close(aa[0]);
-        close(1);
-        if(dup(bb[1]) != 1){
-          fprintf(2, "grind: dup failed\n");
-          exit(5);
-        }
-        close(bb[1]);
-        char *args[2] = { "cat", 0 };
-        exec("/cat", args);
-        fprintf(2, "grind: cat: not found\n");
-        exit(6);
-      } else if(pid2 < 0){
-        fprintf(2, "grind: fork failed\n");
+      struct spawn_action act2[] = {
+        { SPAWN_CLOSE, aa[1] },
+        { SPAWN_CLOSE, bb[0] },
+        { SPAWN_DUP2, aa[0], 0 },
+        { SPAWN_CLOSE, aa[0] },
+        { SPAWN_DUP2, bb[1], 1 },
+        { SPAWN_CLOSE, bb[1] },
+      };
+      char *args2[2] = { "cat", 0 };
+      if(spawn("/cat", args2, act2, sizeof(act2)/sizeof(act2[0])) < 0){
+        fprintf(2, "grind: spawn cat failed\n");
         exit(7);
       }
       close(aa[0]);
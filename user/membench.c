@@ -0,0 +1,90 @@
+// Measure memset, memmove and memcmp in kilobytes per clock
+// tick (see uptime()), for several sizes and with aligned and
+// unaligned buffers. Ticks are coarse, so each run moves many
+// megabytes.
+//
+// usage: membench [iterations]
+
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "user/user.h"
+
+#define BUFSZ (64*1024)
+
+static char *src, *dst;
+
+// print n bytes in t ticks as kilobytes/tick
+static void
+report(char *op, int size, int off, uint64 n, int t)
+{
+  if(t <= 0)
+    t = 1;
+  printf("%s\t%d\t+%d\t%d KB/tick\n", op, size, off, (int)(n / 1024 / t));
+}
+
+static void
+bench(int size, int off, int iters)
+{
+  int t, i;
+
+  t = uptime();
+  for(i = 0; i < iters; i++)
+    memset(dst + off, i, size);
+  report("memset", size, off, (uint64)size * iters, uptime() - t);
+
+  t = uptime();
+  for(i = 0; i < iters; i++)
+    memmove(dst + off, src, size);
+  report("memmove", size, off, (uint64)size * iters, uptime() - t);
+
+  // overlapping, copied from the end down
+  t = uptime();
+  for(i = 0; i < iters; i++)
+    memmove(dst + 8, dst, size);
+  report("memmove>", size, 0, (uint64)size * iters, uptime() - t);
+
+  memmove(dst + off, src, size);
+  t = uptime();
+  for(i = 0; i < iters; i++){
+    if(memcmp(dst + off, src, size) != 0){
+      printf("membench: memcmp of equal buffers failed\n");
+      exit(1);
+    }
+  }
+  report("memcmp", size, off, (uint64)size * iters, uptime() - t);
+}
+
+int
+main(int argc, char *argv[])
+{
+  int sizes[] = { 16, 256, 4096, 32768 };
+  int offs[] = { 0, 3 };
+  int iters = 1 << 22, i, j, n;
+
+  if(argc > 1)
+    iters = atoi(argv[1]);
+  if(iters <= 0){
+    fprintf(2, "usage: membench [iterations]\n");
+    exit(1);
+  }
+
+  src = malloc(BUFSZ);
+  dst = malloc(BUFSZ + 16);
+  if(src == 0 || dst == 0){
+    fprintf(2, "membench: out of memory\n");
+    exit(1);
+  }
+  for(i = 0; i < BUFSZ; i++)
+    src[i] = i;
+
+  printf("op\tsize\talign\tspeed\n");
+  for(i = 0; i < sizeof(sizes)/sizeof(sizes[0]); i++){
+    // keep the bytes moved per size about the same
+    n = iters / sizes[i];
+    if(n < 1)
+      n = 1;
+    for(j = 0; j < sizeof(offs)/sizeof(offs[0]); j++)
+      bench(sizes[i], offs[j], n * 16);
+  }
+  exit(0);
+}
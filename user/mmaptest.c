@@ -9,6 +9,14 @@
 void mmap_test();
 void fork_test();
 void more_test();
+void offset_test();
+void madvise_test();
+void msync_test();
+void big_test();
+void many_test();
+void hole_test();
+void split_test();
+void anon_test();
 char buf[PGSIZE];
 
 #define MAP_FAILED ((char *) -1)
@@ -19,6 +27,14 @@ main(int argc, char *argv[])
   mmap_test();
   fork_test();
   more_test();
+  offset_test();
+  madvise_test();
+  msync_test();
+  big_test();
+  many_test();
+  hole_test();
+  split_test();
+  anon_test();
   printf("mmaptest: all tests succeeded\n");
   exit(0);
 }
@@ -446,4 +462,518 @@ more_test()
     err("child wrote read-only mapping");
 
   printf("test writes to read-only mapped memory: OK\n");
+
+  printf("test jumps into non-executable mapped memory\n");
+
+  pid = fork();
+  if(pid < 0) err("fork");
+  if(pid == 0){
+    if ((fd = open(f, O_RDWR)) == -1)
+      err("open");
+    p = mmap(0, PGSIZE*2, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    if (p == MAP_FAILED)
+      err("mmap");
+    // map the page, then run it: this should cause a fatal fault
+    *p = 0;
+    ((void (*)(void))p)();
+    exit(0);
+  }
+
+  st = 0;
+  wait(&st);
+  if(st != -1)
+    err("child ran non-executable mapping");
+
+  printf("test jumps into non-executable mapped memory: OK\n");
+}
+
+//
+// map a window of the file that does not start at offset 0.
+//
+void
+offset_test()
+{
+  int fd, i;
+  char *p;
+  const char * const f = "mmap.dur";
+
+  printf("test mmap offset\n");
+
+  makefile(f);
+  if ((fd = open(f, O_RDWR)) == -1)
+    err("open");
+
+  // the second page holds half a page of 'A' and then zeros.
+  p = mmap(0, PGSIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, PGSIZE);
+  if (p == MAP_FAILED)
+    err("mmap");
+  for (i = 0; i < PGSIZE; i++) {
+    if (p[i] != (i < PGSIZE/2 ? 'A' : 0))
+      err("offset mapping mismatch");
+  }
+  p[0] = 'O';
+  if (munmap(p, PGSIZE) == -1)
+    err("munmap");
+
+  // unaligned offsets are rejected.
+  if (mmap(0, PGSIZE, PROT_READ, MAP_SHARED, fd, 1) != MAP_FAILED)
+    err("mmap with unaligned offset");
+  close(fd);
+
+  // the store landed at file offset PGSIZE, not 0.
+  if ((fd = open(f, O_RDONLY)) == -1)
+    err("open");
+  if (read(fd, buf, PGSIZE) != PGSIZE)
+    err("read");
+  if (buf[0] != 'A')
+    err("offset mapping wrote the first page");
+  if (read(fd, buf, PGSIZE) != PGSIZE/2)
+    err("read");
+  if (buf[0] != 'O')
+    err("offset mapping did not write the second page");
+  close(fd);
+
+  printf("test mmap offset: OK\n");
+}
+
+//
+// madvise() hints must not change what the mapping contains.
+//
+void
+madvise_test()
+{
+  int fd;
+  char *p;
+  const char * const f = "mmap.dur";
+
+  printf("test madvise\n");
+
+  makefile(f);
+  if ((fd = open(f, O_RDWR)) == -1)
+    err("open");
+  p = mmap(0, PGSIZE*2, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (p == MAP_FAILED)
+    err("mmap");
+  close(fd);
+
+  if (madvise(p, PGSIZE*2, MADV_SEQUENTIAL) == -1)
+    err("madvise sequential");
+  if (madvise(p, PGSIZE*2, MADV_WILLNEED) == -1)
+    err("madvise willneed");
+  _v1(p);
+
+  // dropping a dirty shared page writes it back first.
+  p[0] = 'D';
+  if (madvise(p, PGSIZE, MADV_DONTNEED) == -1)
+    err("madvise dontneed");
+  if (p[0] != 'D')
+    err("MADV_DONTNEED lost a store to a shared mapping");
+
+  // the access pattern is kept for whole mappings only.
+  if (madvise(p, PGSIZE, MADV_RANDOM) != -1)
+    err("madvise accepted part of a mapping");
+
+  if (madvise(p, PGSIZE, 99) != -1)
+    err("madvise accepted bad advice");
+  if (munmap(p, PGSIZE*2) == -1)
+    err("munmap");
+  if (madvise(p, PGSIZE, MADV_NORMAL) != -1)
+    err("madvise accepted an unmapped range");
+
+  printf("test madvise: OK\n");
+}
+
+//
+// msync() writes dirty pages to the file and keeps them mapped.
+//
+void
+msync_test()
+{
+  int fd;
+  char *p;
+  const char * const f = "mmap.dur";
+
+  printf("test msync\n");
+
+  makefile(f);
+  if ((fd = open(f, O_RDWR)) == -1)
+    err("open");
+  p = mmap(0, PGSIZE*2, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (p == MAP_FAILED)
+    err("mmap");
+  close(fd);
+
+  p[0] = 'S';
+  p[PGSIZE] = 'T';
+  if (msync(p, PGSIZE*2, MS_SYNC) == -1)
+    err("msync");
+
+  // the file has the stores while the mapping is still live.
+  if ((fd = open(f, O_RDONLY)) == -1)
+    err("open");
+  if (read(fd, buf, PGSIZE) != PGSIZE || buf[0] != 'S')
+    err("msync did not write the first page");
+  if (read(fd, buf, PGSIZE) != PGSIZE/2 || buf[0] != 'T')
+    err("msync did not write the second page");
+  close(fd);
+  if (p[0] != 'S' || p[PGSIZE] != 'T')
+    err("msync changed the mapping");
+
+  // an asynchronous msync is written in the background, while
+  // the page stays mapped.
+  p[1] = 'U';
+  if (msync(p, PGSIZE, MS_ASYNC) == -1)
+    err("msync async");
+  if (msync(p, PGSIZE, MS_ASYNC | MS_SYNC) != -1)
+    err("msync accepted MS_ASYNC|MS_SYNC");
+  sleep(2*PCFLUSHTICKS);
+  if ((fd = open(f, O_RDONLY)) == -1)
+    err("open");
+  if (read(fd, buf, PGSIZE) != PGSIZE || buf[1] != 'U')
+    err("msync(MS_ASYNC) page was not written in the background");
+  close(fd);
+  if (p[1] != 'U')
+    err("background write changed the mapping");
+  if (munmap(p, PGSIZE*2) == -1)
+    err("munmap");
+  if ((fd = open(f, O_RDONLY)) == -1)
+    err("open");
+  if (read(fd, buf, PGSIZE) != PGSIZE || buf[1] != 'U')
+    err("msync(MS_ASYNC) store was lost");
+  close(fd);
+
+  // a write() to a mapped page shows in the mapping and keeps
+  // the stores to the rest of the page.
+  if ((fd = open(f, O_RDWR)) == -1)
+    err("open");
+  p = mmap(0, PGSIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (p == MAP_FAILED)
+    err("mmap");
+  p[10] = 'm';
+  if (write(fd, "w", 1) != 1)
+    err("write");
+  if (p[0] != 'w')
+    err("write() did not reach the mapping");
+  if (p[10] != 'm')
+    err("write() undid a store to the mapping");
+  if (munmap(p, PGSIZE) == -1)
+    err("munmap");
+  close(fd);
+  if ((fd = open(f, O_RDONLY)) == -1)
+    err("open");
+  if (read(fd, buf, PGSIZE) != PGSIZE || buf[0] != 'w' || buf[10] != 'm')
+    err("write() and store not both in the file");
+  close(fd);
+
+  printf("test msync: OK\n");
+}
+
+//
+// unmapping a mapping much larger than a log transaction
+// writes back every page.
+//
+void
+big_test()
+{
+  int fd, i, pid, st;
+  char *p;
+  const int npages = 20;
+  const char * const f = "mmap.big";
+
+  printf("test big dirty munmap\n");
+
+  unlink(f);
+  if ((fd = open(f, O_RDWR | O_CREATE)) == -1)
+    err("open");
+  memset(buf, 0, PGSIZE);
+  for (i = 0; i < npages; i++) {
+    if (write(fd, buf, PGSIZE) != PGSIZE)
+      err("write");
+  }
+  p = mmap(0, PGSIZE*npages, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (p == MAP_FAILED)
+    err("mmap");
+  close(fd);
+
+  for (i = 0; i < PGSIZE*npages; i++)
+    p[i] = 'a' + (i / PGSIZE);
+
+  // another process writes a file meanwhile, so the log is shared
+  // with the write-back transactions.
+  pid = fork();
+  if (pid < 0)
+    err("fork");
+  if (pid == 0) {
+    unlink("mmap.other");
+    if ((fd = open("mmap.other", O_RDWR | O_CREATE)) == -1)
+      exit(1);
+    for (i = 0; i < npages; i++) {
+      if (write(fd, buf, PGSIZE) != PGSIZE)
+        exit(1);
+    }
+    close(fd);
+    unlink("mmap.other");
+    exit(0);
+  }
+  if (munmap(p, PGSIZE*npages) == -1)
+    err("munmap");
+  st = -1;
+  wait(&st);
+  if (st != 0)
+    err("concurrent writer failed");
+
+  if ((fd = open(f, O_RDONLY)) == -1)
+    err("open");
+  for (i = 0; i < npages; i++) {
+    if (read(fd, buf, PGSIZE) != PGSIZE)
+      err("read");
+    if (buf[0] != 'a' + i || buf[PGSIZE-1] != 'a' + i)
+      err("page not written back");
+  }
+  if (read(fd, buf, 1) != 0)
+    err("munmap grew the file");
+  close(fd);
+  unlink(f);
+
+  printf("test big dirty munmap: OK\n");
+}
+
+//
+// a process can have many more mappings than it has open files.
+//
+void
+many_test()
+{
+  int fd, i;
+  const int n = 100;
+  static char *maps[100];
+  const char * const f = "mmap.dur";
+
+  printf("test many mappings\n");
+
+  makefile(f);
+  if ((fd = open(f, O_RDONLY)) == -1)
+    err("open");
+  for (i = 0; i < n; i++) {
+    maps[i] = mmap(0, PGSIZE, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (maps[i] == MAP_FAILED)
+      err("mmap");
+  }
+  close(fd);
+
+  for (i = 0; i < n; i++) {
+    if (maps[i][0] != 'A')
+      err("many mappings mismatch");
+  }
+  for (i = 0; i < n; i++) {
+    if (munmap(maps[i], PGSIZE) == -1)
+      err("munmap");
+  }
+
+  printf("test many mappings: OK\n");
+}
+
+//
+// unmapped address ranges are handed out again, and a free
+// address hint is honored.
+//
+void
+hole_test()
+{
+  int fd;
+  char *p1, *p2, *p3, *hint;
+  const char * const f = "mmap.dur";
+
+  printf("test mmap hole reuse\n");
+
+  makefile(f);
+  if ((fd = open(f, O_RDONLY)) == -1)
+    err("open");
+  p1 = mmap(0, PGSIZE, PROT_READ, MAP_PRIVATE, fd, 0);
+  p2 = mmap(0, PGSIZE, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (p1 == MAP_FAILED || p2 == MAP_FAILED)
+    err("mmap");
+  if (munmap(p1, PGSIZE) == -1)
+    err("munmap");
+  p3 = mmap(0, PGSIZE, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (p3 != p1)
+    err("unmapped range was not reused");
+
+  hint = p2 - 16*PGSIZE;
+  p1 = mmap(hint, PGSIZE, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (p1 != hint)
+    err("free address hint was not honored");
+  if (p1[0] != 'A')
+    err("hinted mapping mismatch");
+  close(fd);
+
+  if (munmap(p1, PGSIZE) == -1 || munmap(p2, PGSIZE) == -1 ||
+      munmap(p3, PGSIZE) == -1)
+    err("munmap");
+
+  printf("test mmap hole reuse: OK\n");
+}
+
+//
+// munmap of the middle of a mapping leaves the two ends mapped,
+// and adjacent mappings of adjacent file ranges are merged.
+//
+void
+split_test()
+{
+  int fd, pid, st;
+  char *p, *q;
+  const char * const f = "mmap.dur";
+
+  printf("test munmap hole\n");
+
+  makefile(f);
+  if ((fd = open(f, O_RDWR)) == -1)
+    err("open");
+  p = mmap(0, PGSIZE*3, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (p == MAP_FAILED)
+    err("mmap");
+  p[0] = 'x';
+  p[PGSIZE] = 'y';
+  p[PGSIZE*2] = 'z';
+  if (munmap(p + PGSIZE, PGSIZE) == -1)
+    err("munmap middle page");
+  if (p[0] != 'x' || p[PGSIZE*2] != 'z')
+    err("munmap of the middle changed the ends");
+
+  pid = fork();
+  if (pid < 0)
+    err("fork");
+  if (pid == 0) {
+    // this should cause a fatal fault
+    printf("*(p+PGSIZE) = %x\n", p[PGSIZE]);
+    exit(0);
+  }
+  st = 0;
+  wait(&st);
+  if (st != -1)
+    err("child read the unmapped middle page");
+
+  if (munmap(p, PGSIZE) == -1 || munmap(p + PGSIZE*2, PGSIZE) == -1)
+    err("munmap ends");
+
+  // the middle page was written back when it was unmapped.
+  close(fd);
+  if ((fd = open(f, O_RDWR)) == -1)
+    err("open");
+  if (read(fd, buf, PGSIZE) != PGSIZE || buf[0] != 'x')
+    err("first page not written back");
+  if (read(fd, buf, PGSIZE) != PGSIZE/2 || buf[0] != 'y')
+    err("middle page not written back");
+
+  // map the first page right before the second: one area.
+  q = mmap(0, PGSIZE, PROT_READ, MAP_SHARED, fd, PGSIZE);
+  if (q == MAP_FAILED)
+    err("mmap");
+  p = mmap(q - PGSIZE, PGSIZE, PROT_READ, MAP_SHARED, fd, 0);
+  if (p != q - PGSIZE)
+    err("mmap with hint");
+  close(fd);
+  if (p[0] != 'x' || q[0] != 'y')
+    err("adjacent mappings mismatch");
+  if (munmap(p, PGSIZE*2) == -1)
+    err("adjacent mappings were not merged");
+
+  // a merged area can be unmapped in pieces, and the pieces
+  // still mapped go away with the process.
+  pid = fork();
+  if (pid < 0)
+    err("fork");
+  if (pid == 0) {
+    if ((fd = open(f, O_RDWR)) == -1)
+      exit(1);
+    q = mmap(0, PGSIZE*4, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, PGSIZE*4);
+    if (q == MAP_FAILED)
+      exit(1);
+    p = mmap(q - PGSIZE*4, PGSIZE*4, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    if (p != q - PGSIZE*4)
+      exit(1);
+    close(fd);
+    p[0] = 1;
+    q[PGSIZE*3] = 2;
+    if (munmap(p + PGSIZE*2, PGSIZE*4) == -1)
+      exit(1);
+    if (munmap(p + PGSIZE, PGSIZE) == -1 || munmap(p + PGSIZE*7, PGSIZE) == -1)
+      exit(1);
+    if (p[0] != 1)
+      exit(1);
+    exit(0);
+  }
+  st = -1;
+  wait(&st);
+  if (st != 0)
+    err("unmapping a merged area in pieces");
+
+  printf("test munmap hole: OK\n");
+}
+
+//
+// anonymous private memory reads as zeros, is only allocated for
+// pages that are written, and is copied by fork.
+//
+void
+anon_test()
+{
+  int i, pid, st;
+  char *p;
+  const int n = 1024;
+
+  printf("test anonymous mmap\n");
+
+  if (mmap(0, PGSIZE, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0) != MAP_FAILED)
+    err("shared anonymous mmap succeeded");
+
+  // 4 megabytes, more than a sparse use of it needs.
+  p = mmap(0, PGSIZE*n, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (p == MAP_FAILED)
+    err("mmap");
+  for (i = 0; i < n; i++)
+    if (p[i*PGSIZE] != 0)
+      err("anonymous page not zero");
+  for (i = 0; i < n; i += 64)
+    p[i*PGSIZE + 1] = i / 64 + 1;
+  if (p[PGSIZE + 1] != 0)
+    err("write reached another page");
+
+  pid = fork();
+  if (pid < 0)
+    err("fork");
+  if (pid == 0) {
+    for (i = 0; i < n; i += 64)
+      if (p[i*PGSIZE + 1] != i / 64 + 1)
+        exit(1);
+    p[1] = 'c';
+    exit(0);
+  }
+  st = -1;
+  wait(&st);
+  if (st != 0)
+    err("child did not see the parent's anonymous pages");
+  if (p[1] != 1)
+    err("child's write reached the parent");
+
+  if (munmap(p, PGSIZE*n) == -1)
+    err("munmap");
+
+  // written before it is read, the memory may come in superpages;
+  // unmapping part of one must keep the rest.
+  p = mmap(0, PGSIZE*n, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (p == MAP_FAILED)
+    err("mmap");
+  for (i = 0; i < n; i++)
+    p[i*PGSIZE] = i % 100 + 1;
+  if (munmap(p + PGSIZE*(n/2 + 1), PGSIZE*8) == -1)
+    err("munmap");
+  for (i = 0; i < n; i++)
+    if ((i <= n/2 || i >= n/2 + 9) && p[i*PGSIZE] != i % 100 + 1)
+      err("partial munmap lost anonymous data");
+  if (munmap(p, PGSIZE*(n/2 + 1)) == -1 || munmap(p + PGSIZE*(n/2 + 9), PGSIZE*(n - n/2 - 9)) == -1)
+    err("munmap");
+
+  printf("test anonymous mmap: OK\n");
 }
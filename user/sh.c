@@ -3,6 +3,7 @@
 #include "kernel/types.h"
 #include "user/user.h"
 #include "kernel/fcntl.h"
+#include "kernel/spawn.h"
 
 // Parsed command representation
 #define EXEC  1
@@ -50,6 +51,7 @@ struct backcmd {
 };
 
 int fork1(void);  // Fork but panics on failure.
+int pipeside(struct cmd*, int*, int);
 void panic(char*);
 struct cmd *parsecmd(char*);
 void runcmd(struct cmd*) __attribute__((noreturn));
@@ -58,7 +60,7 @@ void runcmd(struct cmd*) __attribute__((noreturn));
 void
 runcmd(struct cmd *cmd)
 {
-  int p[2];
+  int p[2], n;
   struct backcmd *bcmd;
   struct execcmd *ecmd;
   struct listcmd *lcmd;
@@ -102,24 +104,15 @@ runcmd(struct cmd *cmd)
     pcmd = (struct pipecmd*)cmd;
     if(pipe(p) < 0)
       panic("pipe");
-    if(fork1() == 0){
-      close(1);
-      dup(p[1]);
-      close(p[0]);
-      close(p[1]);
-      runcmd(pcmd->left);
-    }
-    if(fork1() == 0){
-      close(0);
-      dup(p[0]);
-      close(p[0]);
-      close(p[1]);
-      runcmd(pcmd->right);
-    }
+    n = 0;
+    if(pipeside(pcmd->left, p, 1) >= 0)
+      n++;
+    if(pipeside(pcmd->right, p, 0) >= 0)
+      n++;
     close(p[0]);
     close(p[1]);
-    wait(0);
-    wait(0);
+    while(n-- > 0)
+      wait(0);
     break;
 
   case BACK:
@@ -131,6 +124,37 @@ runcmd(struct cmd *cmd)
   exit(0);
 }
 
+// Start one side of a pipeline with io (0 or 1) connected
+// to its end of the pipe p. A simple command is spawned
+// directly rather than by forking a copy of the shell to
+// exec it. Returns the child's pid, or -1.
+int
+pipeside(struct cmd *cmd, int *p, int io)
+{
+  struct execcmd *ecmd;
+  struct spawn_action act[3];
+  int pid;
+
+  ecmd = (struct execcmd*)cmd;
+  if(cmd->type == EXEC && ecmd->argv[0] != 0){
+    act[0] = (struct spawn_action){ SPAWN_DUP2, p[io], io };
+    act[1] = (struct spawn_action){ SPAWN_CLOSE, p[0], 0 };
+    act[2] = (struct spawn_action){ SPAWN_CLOSE, p[1], 0 };
+    if((pid = spawn(ecmd->argv[0], ecmd->argv, act, 3)) < 0)
+      fprintf(2, "exec %s failed\n", ecmd->argv[0]);
+    return pid;
+  }
+
+  if((pid = fork1()) == 0){
+    close(io);
+    dup(p[io]);
+    close(p[0]);
+    close(p[1]);
+    runcmd(cmd);
+  }
+  return pid;
+}
+
 int
 getcmd(char *buf, int nbuf)
 {
@@ -3,6 +3,7 @@ typedef unsigned long size_t;
 typedef long int off_t;
 #endif
 struct stat;
+struct spawn_action;
 
 // system calls
 int fork(void);
@@ -14,6 +15,7 @@ int read(int, void*, int);
 int close(int);
 int kill(int);
 int exec(const char*, char**);
+int spawn(const char*, char**, struct spawn_action*, int);
 int open(const char*, int);
 int mknod(const char*, short, short);
 int unlink(const char*);
@@ -41,6 +43,8 @@ void kpgtbl(void);
 void *mmap(void *addr, size_t len, int prot, int flags,
            int fd, off_t offset);
 int munmap(void *addr, size_t len);
+int madvise(void *addr, size_t len, int advice);
+int msync(void *addr, size_t len, int flags);
 
 // ulib.c
 int stat(const char*, struct stat*);
@@ -7,6 +7,7 @@
 #include "kernel/syscall.h"
 #include "kernel/memlayout.h"
 #include "kernel/riscv.h"
+#include "kernel/spawn.h"
 
 //
 // Tests xv6 system calls.  usertests without arguments runs them all
@@ -733,6 +734,50 @@ exectest(char *s)
 
 }
 
+// spawn a process with its stdout on a pipe.
+void
+spawntest(char *s)
+{
+  int p[2], pid, xstatus;
+  char *echoargv[] = { "echo", "OK", 0 };
+  char buf[4];
+
+  if(pipe(p) < 0){
+    printf("%s: pipe failed\n", s);
+    exit(1);
+  }
+  struct spawn_action act[] = {
+    { SPAWN_DUP2, p[1], 1 },
+    { SPAWN_CLOSE, p[0] },
+    { SPAWN_CLOSE, p[1] },
+  };
+  struct spawn_action badact[] = { { SPAWN_DUP2, NOFILE-1, 1 } };
+
+  if(spawn("echo", echoargv, badact, 1) >= 0){
+    printf("%s: spawn with a closed fd succeeded\n", s);
+    exit(1);
+  }
+  if(spawn("nosuchfile", echoargv, act, 3) >= 0){
+    printf("%s: spawn of a missing file succeeded\n", s);
+    exit(1);
+  }
+  pid = spawn("echo", echoargv, act, 3);
+  if(pid < 0){
+    printf("%s: spawn echo failed\n", s);
+    exit(1);
+  }
+  close(p[1]);
+  if(read(p[0], buf, 3) != 3 || buf[0] != 'O' || buf[1] != 'K'){
+    printf("%s: wrong output\n", s);
+    exit(1);
+  }
+  close(p[0]);
+  if(wait(&xstatus) != pid || xstatus != 0){
+    printf("%s: wait failed\n", s);
+    exit(1);
+  }
+}
+
 // simple fork and pipe read/write
 
 void
@@ -1781,6 +1826,76 @@ bigfile(char *s)
   unlink("bigfile.dat");
 }
 
+// sequential reads are read ahead; reading after a write moved
+// the offset must still see the file as it is.
+void
+readahead(char *s)
+{
+  enum { N = 200 };
+  int fd, i, j;
+
+  unlink("readahead.dat");
+  fd = open("readahead.dat", O_CREATE | O_RDWR);
+  if(fd < 0){
+    printf("%s: cannot create readahead.dat\n", s);
+    exit(1);
+  }
+  for(i = 0; i < N; i++){
+    memset(buf, i, BSIZE);
+    if(write(fd, buf, BSIZE) != BSIZE){
+      printf("%s: write readahead.dat failed\n", s);
+      exit(1);
+    }
+  }
+  close(fd);
+
+  // odd-sized reads, so they straddle blocks
+  fd = open("readahead.dat", O_RDWR);
+  for(i = 0; i < N*BSIZE; i += 700){
+    int n = N*BSIZE - i < 700 ? N*BSIZE - i : 700;
+    if(read(fd, buf, 700) != n){
+      printf("%s: short read\n", s);
+      exit(1);
+    }
+    for(j = 0; j < n; j++){
+      if(buf[j] != (char)((i + j) / BSIZE)){
+        printf("%s: wrong data at %d\n", s, i + j);
+        exit(1);
+      }
+    }
+  }
+  close(fd);
+
+  // alternate reads and writes, which move the offset
+  fd = open("readahead.dat", O_RDWR);
+  for(i = 0; i < N; i += 2){
+    if(read(fd, buf, BSIZE) != BSIZE || buf[0] != (char)i || buf[BSIZE-1] != (char)i){
+      printf("%s: wrong data in block %d\n", s, i);
+      exit(1);
+    }
+    memset(buf, 0xaa, BSIZE);
+    if(write(fd, buf, BSIZE) != BSIZE){
+      printf("%s: write failed\n", s);
+      exit(1);
+    }
+  }
+  close(fd);
+
+  fd = open("readahead.dat", 0);
+  for(i = 0; i < N; i++){
+    if(read(fd, buf, BSIZE) != BSIZE){
+      printf("%s: short read\n", s);
+      exit(1);
+    }
+    if(buf[0] != (char)(i % 2 ? 0xaa : i) || buf[BSIZE-1] != buf[0]){
+      printf("%s: block %d not rewritten\n", s, i);
+      exit(1);
+    }
+  }
+  close(fd);
+  unlink("readahead.dat");
+}
+
 void
 fourteen(char *s)
 {
@@ -1996,6 +2111,53 @@ forktest(char *s)
   }
 }
 
+// fork a process holding more than half of physical memory,
+// which works only if fork shares pages copy-on-write, and check
+// that stores by either process are not seen by the other.
+void
+cowfork(char *s)
+{
+  enum { SZ = 80*1024*1024 };
+  char *a, *p;
+  int pid, xstatus;
+
+  a = sbrk(SZ);
+  if(a == (char*)0xffffffffffffffffL){
+    printf("%s: sbrk(%d) failed\n", s, SZ);
+    exit(1);
+  }
+  for(p = a; p < a + SZ; p += 4096)
+    *(int*)p = (uint64)p / 4096;
+
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    for(p = a; p < a + SZ; p += 64*4096){
+      if(*(int*)p != (uint64)p / 4096)
+        exit(1);
+      *(int*)p = -1;
+    }
+    exit(0);
+  }
+  for(p = a + 32*4096; p < a + SZ; p += 64*4096)
+    *(int*)p = 0;
+  wait(&xstatus);
+  if(xstatus != 0){
+    printf("%s: child saw wrong data\n", s);
+    exit(1);
+  }
+  for(p = a; p < a + SZ; p += 4096){
+    if(*(int*)p != (((p - a) / 4096) % 64 == 32 ? 0 : (uint64)p / 4096)){
+      printf("%s: parent saw the child's store\n", s);
+      exit(1);
+    }
+  }
+  sbrk(-SZ);
+}
+
 void
 sbrkbasic(char *s)
 {
@@ -2238,6 +2400,111 @@ sbrkfail(char *s)
 }
 
   
+// sbrk only reserves address space: more than physical memory
+// can be reserved, untouched pages read as zero, and system calls
+// can copy to and from pages that were never touched.
+void
+sbrklazy(char *s)
+{
+  enum { BIG=512*1024*1024 };
+  char *a, *p;
+  int fds[2];
+
+  a = sbrk(BIG);
+  if(a == (char*)0xffffffffffffffffL){
+    printf("%s: sbrk(%d) failed\n", s, BIG);
+    exit(1);
+  }
+  for(p = a; p < a + BIG; p += 1024*PGSIZE){
+    if(*p != 0){
+      printf("%s: untouched heap not zero\n", s);
+      exit(1);
+    }
+    *p = 1;
+  }
+
+  if(pipe(fds) != 0){
+    printf("%s: pipe() failed\n", s);
+    exit(1);
+  }
+  if(write(fds[1], a + BIG/2 + PGSIZE, 5) != 5){
+    printf("%s: write from untouched heap failed\n", s);
+    exit(1);
+  }
+  p = a + BIG - 10;
+  if(read(fds[0], p, 5) != 5 || p[0] != 0 || p[4] != 0){
+    printf("%s: read into untouched heap failed\n", s);
+    exit(1);
+  }
+  close(fds[0]);
+  close(fds[1]);
+
+  sbrk(-BIG);
+}
+
+// heap memory touched a whole superpage (2 MB) at a time
+// may be backed by superpages; fork and shrinking the heap
+// into the middle of one must keep its contents.
+void
+sbrksuper(char *s)
+{
+  enum { SUPER=512*PGSIZE, N=3*SUPER };
+  char *a, *top;
+  uint64 i;
+  int pid, xstatus;
+
+  top = sbrk(0);
+  a = sbrk(N + SUPER);
+  if(a == (char*)0xffffffffffffffffL){
+    printf("%s: sbrk failed\n", s);
+    exit(1);
+  }
+  a = (char*)(((uint64)a + SUPER - 1) & ~(uint64)(SUPER - 1));
+  for(i = 0; i < N; i += PGSIZE)
+    a[i] = i / PGSIZE % 128;
+
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    for(i = 0; i < N; i += PGSIZE){
+      if(a[i] != i / PGSIZE % 128)
+        exit(1);
+      a[i] = -1;
+    }
+    exit(0);
+  }
+  wait(&xstatus);
+  if(xstatus != 0){
+    printf("%s: child saw wrong heap contents\n", s);
+    exit(1);
+  }
+  for(i = 0; i < N; i += PGSIZE){
+    if(a[i] != i / PGSIZE % 128){
+      printf("%s: child's write reached the parent\n", s);
+      exit(1);
+    }
+  }
+
+  // cut the last superpage in the middle
+  sbrk(-((char*)sbrk(0) - (a + N - SUPER/2)));
+  for(i = 0; i < N - SUPER/2; i += PGSIZE){
+    if(a[i] != i / PGSIZE % 128){
+      printf("%s: shrinking the heap lost data\n", s);
+      exit(1);
+    }
+  }
+  sbrk(SUPER/2);
+  if(a[N - PGSIZE] != 0){
+    printf("%s: regrown heap not zero\n", s);
+    exit(1);
+  }
+
+  sbrk(-((char*)sbrk(0) - top));
+}
+
 // test reads/writes from/to allocated memory
 void
 sbrkarg(char *s)
@@ -2608,6 +2875,7 @@ struct test {
   {createtest, "createtest"},
   {dirtest, "dirtest"},
   {exectest, "exectest"},
+  {spawntest, "spawntest"},
   {pipe1, "pipe1"},
   {killstatus, "killstatus"},
   {preempt, "preempt"},
@@ -2628,17 +2896,21 @@ struct test {
   {subdir, "subdir"},
   {bigwrite, "bigwrite"},
   {bigfile, "bigfile"},
+  {readahead, "readahead"},
   {fourteen, "fourteen"},
   {rmdot, "rmdot"},
   {dirfile, "dirfile"},
   {iref, "iref"},
   {forktest, "forktest"},
+  {cowfork, "cowfork"},
   {sbrkbasic, "sbrkbasic"},
   {sbrkmuch, "sbrkmuch"},
   {kernmem, "kernmem"},
   {MAXVAplus, "MAXVAplus"},
   {sbrkfail, "sbrkfail"},
   {sbrkarg, "sbrkarg"},
+  {sbrklazy, "sbrklazy"},
+  {sbrksuper, "sbrksuper"},
   {validatetest, "validatetest"},
   {bsstest, "bsstest"},
   {bigargtest, "bigargtest"},
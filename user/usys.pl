@@ -38,3 +38,6 @@ entry("sleep");
 entry("uptime");
 entry("mmap");
 entry("munmap");
+entry("madvise");
+entry("msync");
+entry("spawn");